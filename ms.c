@@ -107,7 +107,8 @@
 
 #define SITESINC 10
 
-unsigned maxsites = SITESINC ;
+__thread unsigned maxsites = SITESINC ;	/* per simulation thread (--threads) */
+int segmentThreads = 1 ;	/* threads generating the mutations of the segments of a replicate (--segment-threads) */
 
 struct segl {
 	int beg;
@@ -121,7 +122,6 @@ int main(int argc, char *argv[]){
 	int ntbs;
 	int count;
 	int i, k, howmany, segsites ;
-	char **tbsparamstrs ;
 	double probss, tmrca, ttot ;
 	struct params pars ;
 	void seedit( const char * ) ;
@@ -129,34 +129,87 @@ int main(int argc, char *argv[]){
 
     int samples;
     char *workerOutput, *results, *singleResult;
+    struct msparOptions options;
 
-	ntbs = 0 ;   /* these next few lines are for reading in parameters from a file (for each sample) */
-	tbsparamstrs = (char **)malloc( argc*sizeof(char *) ) ;
+#ifdef MSPAR_THREADS
+    serviceSetup(&argc, &argv);     // --serve and --connect (mspar-threads alone)
+#endif
+    argc = parseMsparOptions(argc, argv, &options);
+    segmentThreads = options.segmentThreads;
 
-	for( i =0; i<argc; i++) tbsparamstrs[i] = (char *)malloc(30*sizeof(char) ) ;
+	ntbs = 0 ;   /* "tbs" arguments take a value per sample, read from stdin (see tbsArgument) */
 	for( i = 1; i<argc ; i++)
-			if( strcmp( argv[i],"tbs") == 0 )  argv[i] = tbsparamstrs[ ntbs++] ;
+			if( strcmp( argv[i],"tbs") == 0 )  ntbs++ ;
 
     count=0;
-	pars = getpars(argc, argv, &howmany, ntbs, count);
+    if(options.sweep != NULL)
+        pars = loadSweep(options.sweep, argv[0], &howmany);
+    else
+        pars = getpars(argc, argv, &howmany, ntbs, count);
+    initializeAbc(options);
+    if(options.replay >= howmany) { fprintf(stderr," --replay must be lower than howmany.\n"); usage(); }
 
     // Master-Worker
-    int myRank = masterWorkerSetup(argc, argv, howmany, pars);
+    int myRank = masterWorkerSetup(argc, argv, howmany, pars, options);
 
     if(myRank <= howmany && myRank > 0)
     {
-        while(workerProcess(myRank, pars, maxsites));
+        workerProcess(myRank, howmany, pars, options);
     }
 
     masterWorkerTeardown();
 }
 
+/* Segment of a replicate, whose mutations are generated apart from the other segments' (see mutateSegments). */
+struct segmentJob {
+	struct node *ptree;	/* tree of the segment, freed once its gametes are made */
+	double beg, len;	/* the segment, as a fraction of the sequence */
+	double tseg;		/* expected mutations per unit of tree length */
+	double tt;		/* tree length the mutations are placed along */
+	int segsit;		/* segregating sites of the segment */
+	int ns;			/* sites of the segments before it */
+};
+
+/* Mutations of the segments of a replicate, handed out to a team of threads. */
+struct segmentWork {
+	int stage;		/* SEGMENT_SITES or SEGMENT_GAMETES */
+	int replicate;
+	int nsam, mfreq;
+	char **list;
+	double *posit;
+	struct segmentJob *jobs;
+	int njobs;
+	int next;		/* next job to be taken */
+};
+
+#define SEGMENT_SITES 1		/* draw the number of segregating sites of each segment */
+#define SEGMENT_GAMETES 2	/* make the gametes and locate the sites of each segment */
+
+/* Helper threads of a simulation thread, started the first time it mutates segments in parallel and kept for the
+   rest of the process: every stage of every replicate is handed over to them, instead of starting threads anew. */
+struct segmentTeam {
+	pthread_mutex_t lock;	/* guards everything below */
+	pthread_cond_t start;	/* signalled when a stage is handed over */
+	pthread_cond_t done;	/* signalled when the last helper is done with the stage */
+	struct segmentWork *work;	/* the stage */
+	int round;		/* stages handed over so far */
+	int busy;		/* helpers still on the stage */
+};
+
+__thread struct segmentTeam *segmentTeam = NULL ;	/* the team of the simulation thread, NULL until needed */
+
+void mutateSegments( struct segmentWork *work );
+struct segmentTeam *startSegmentTeam( int nhelpers );
+void *segmentHelper( void *arg );
+void *segmentThread( void *arg );
+void mutateSegment( struct segmentWork *work, struct segmentJob *job, int k );
+
 	struct gensam_result
-gensam( char **list, double *pprobss, double *ptmrca, double *pttot, struct params pars, int *ns)
+gensam( char **list, double *pprobss, double *ptmrca, double *pttot, struct params pars, int *ns, int replicate)
 {
 	double *posit;
 	double segfac;
-	int nsegs, h, i, k, j, seg, start, end, len, segsit ;
+	int nsegs, h, i, k, j, seg, start, end, len ;
 	struct segl *seglst, *segtre_mig(struct c_params *p, int *nsegs ) ; /* used to be: [MAXSEG];  */
 	double nsinv,  tseg, tt, ttime(struct node *, int nsam), ttimemf(struct node *, int nsam, int mfreq) ;
 	double *pk;
@@ -164,10 +217,11 @@ gensam( char **list, double *pprobss, double *ptmrca, double *pttot, struct para
 	int segsitesin,nsites;
 	double theta, es ;
 	int nsam, mfreq ;
-	char *prtree( struct node *ptree, int nsam);
-	void make_gametes(int nsam, int mfreq,  struct node *ptree, double tt, int newsites, int ns, char **list );
+	void prtree( struct node *ptree, int nsam, struct outputBuffer *trees);
+	static __thread struct outputBuffer trees ;	/* per simulation thread (--threads) */
  	void ndes_setup( struct node *, int nsam );
 	struct gensam_result result;
+	struct segmentWork work;
 
     if( pars.mp.segsitesin ==  0 ) {
      posit = (double *)malloc( (unsigned)( maxsites*sizeof( double)) ) ;
@@ -191,23 +245,21 @@ gensam( char **list, double *pprobss, double *ptmrca, double *pttot, struct para
 
 	if( pars.mp.treeflag ) {
 	  	*ns = 0 ;
-		char *tempString;
-		char *treeOutput = malloc(3);
-	    sprintf(treeOutput, "\n");
+		/* built in the thread's buffer, reused sample after sample */
+		trees.length = 0 ;
+		bufferAppend( &trees, "\n", 1 );
 	    for( seg=0, k=0; k<nsegs; seg=seglst[seg].next, k++) {
 	      if( (pars.cp.r > 0.0 ) || (pars.cp.f > 0.0) ){
 		     end = ( k<nsegs-1 ? seglst[seglst[seg].next].beg -1 : nsites-1 );
 		     start = seglst[seg].beg ;
 		     len = end - start + 1 ;
-			 asprintf(&tempString, "[%d]", len);
-			 treeOutput = append(treeOutput, tempString);
+			 bufferPrintf( &trees, "[%d]", len );
 	      }
-	      treeOutput = append(treeOutput, prtree( seglst[seg].ptree, nsam )) ;
+	      prtree( seglst[seg].ptree, nsam, &trees ) ;
 	      if( (segsitesin == 0) && ( theta == 0.0 ) && ( pars.mp.timeflag == 0 ) )
 	  	      free(seglst[seg].ptree) ;
 	    }
-		result.tree = treeOutput;
-		printf(treeOutput);
+		result.tree = trees.text;
 	}
 
 	if( pars.mp.timeflag ) {
@@ -228,33 +280,46 @@ gensam( char **list, double *pprobss, double *ptmrca, double *pttot, struct para
 		*pttot = tt ;
 	 }
 
-    if( (segsitesin == 0) && ( theta > 0.0)   )
+    /* The mutations of every segment are drawn from substreams of their own, so segments are mutated in parallel */
+    work.replicate = replicate ;
+    work.nsam = nsam ;
+    work.mfreq = mfreq ;
+    work.list = list ;
+    work.njobs = nsegs ;
+    work.jobs = (struct segmentJob *)malloc( (unsigned)(nsegs*sizeof(struct segmentJob)) ) ;
+    if( work.jobs == NULL ) perror("malloc error. gensam.3");
+    for( seg=0, k=0; k<nsegs; seg=seglst[seg].next, k++)
     {
-	  *ns = 0 ;
-	  for( seg=0, k=0; k<nsegs; seg=seglst[seg].next, k++)
-	  {
-        if( mfreq > 1 ) ndes_setup( seglst[seg].ptree, nsam );
         end = ( k<nsegs-1 ? seglst[seglst[seg].next].beg -1 : nsites-1 );
         start = seglst[seg].beg ;
         len = end - start + 1 ;
-        tseg = len*(theta/nsites) ;
-        if( mfreq == 1) tt = ttime(seglst[seg].ptree, nsam);
-        else tt = ttimemf(seglst[seg].ptree, nsam, mfreq );
-        segsit = poisso( tseg*tt );
-        if( (segsit + *ns) >= maxsites )
-        {
-            maxsites = segsit + *ns + SITESINC ;
-            posit = (double *)realloc(posit, maxsites*sizeof(double) ) ;
-            biggerlist(nsam, list) ;
-        }
-
-        make_gametes(nsam,mfreq,seglst[seg].ptree,tt, segsit, *ns, list );
+        work.jobs[k].ptree = seglst[seg].ptree ;
+        work.jobs[k].beg = start*nsinv ;
+        work.jobs[k].len = len*nsinv ;
+        work.jobs[k].tseg = len*(theta/nsites) ;
+    }
 
-        free(seglst[seg].ptree) ;
+    if( (segsitesin == 0) && ( theta > 0.0)   )
+    {
+	  work.stage = SEGMENT_SITES ;
+	  mutateSegments( &work );
 
-        locate(segsit,start*nsinv, len*nsinv,posit + *ns);
-        *ns += segsit;
+	  *ns = 0 ;
+	  for( k=0; k<nsegs; k++)
+	  {
+        work.jobs[k].ns = *ns ;
+        *ns += work.jobs[k].segsit ;
+	  }
+	  if( *ns >= maxsites )
+	  {
+        maxsites = *ns + SITESINC ;
+        posit = (double *)realloc(posit, maxsites*sizeof(double) ) ;
+        biggerlist(nsam, list) ;
 	  }
+
+	  work.stage = SEGMENT_GAMETES ;
+	  work.posit = posit ;
+	  mutateSegments( &work );
     }
     else if( segsitesin > 0 )
     {
@@ -293,21 +358,132 @@ gensam( char **list, double *pprobss, double *ptmrca, double *pttot, struct para
          start = seglst[seg].beg ;
          len = end - start + 1 ;
          tseg = len/(double)nsites;
-         make_gametes(nsam,mfreq,seglst[seg].ptree,tt*pk[k]/tseg, ss[k], *ns, list);
-
-         free(seglst[seg].ptree) ;
-         locate(ss[k],start*nsinv, len*nsinv,posit + *ns);
+         work.jobs[k].tt = tt*pk[k]/tseg ;
+         work.jobs[k].segsit = ss[k] ;
+         work.jobs[k].ns = *ns ;
          *ns += ss[k] ;
         }
+        work.stage = SEGMENT_GAMETES ;
+        work.posit = posit ;
+        mutateSegments( &work );
         free(pk);
         free(ss);
     }
 	for(i=0;i<nsam;i++) list[i][*ns] = '\0' ;
+	free(work.jobs);
 
 	result.positions = posit;
 	return result;
 }
 
+/* Mutates the segments of a replicate, with the calling thread and its team of segmentThreads-1 helpers when there
+   are segments enough to go around. Every segment draws from substreams of the replicate's stream of its own, so the
+   mutations do not depend on the threads nor on the order the segments are mutated in. */
+	void
+mutateSegments( struct segmentWork *work )
+{
+	struct segmentTeam *team;
+
+	work->next = 0 ;
+	if( segmentThreads <= 1 || work->njobs <= 1 ) {
+	   segmentThread( work );
+	   return;
+	   }
+
+	if( segmentTeam == NULL ) segmentTeam = startSegmentTeam( segmentThreads-1 );
+	team = segmentTeam ;
+	pthread_mutex_lock( &team->lock );
+	team->work = work ;
+	team->busy = segmentThreads-1 ;
+	team->round++ ;
+	pthread_cond_broadcast( &team->start );
+	pthread_mutex_unlock( &team->lock );
+
+	segmentThread( work );
+
+	pthread_mutex_lock( &team->lock );
+	while( team->busy > 0 ) pthread_cond_wait( &team->done, &team->lock );
+	pthread_mutex_unlock( &team->lock );
+}
+
+/* Starts the helpers of a team. They wait for the stages handed over for as long as the process runs. */
+	struct segmentTeam *
+startSegmentTeam( int nhelpers )
+{
+	struct segmentTeam *team;
+	pthread_t thread;
+	int i;
+
+	team = (struct segmentTeam *)calloc( 1, sizeof(struct segmentTeam) ) ;
+	if( team == NULL ) perror("malloc error. startSegmentTeam");
+	pthread_mutex_init( &team->lock, NULL );
+	pthread_cond_init( &team->start, NULL );
+	pthread_cond_init( &team->done, NULL );
+	for( i=0; i<nhelpers; i++) {
+	   if( pthread_create( &thread, NULL, segmentHelper, team ) != 0 ) perror("pthread error. startSegmentTeam");
+	   pthread_detach( thread );
+	   }
+	return( team );
+}
+
+/* Loop of a helper of a team: takes part in every stage handed over to the team. */
+	void *
+segmentHelper( void *arg )
+{
+	struct segmentTeam *team = arg ;
+	struct segmentWork *work;
+	int round = 0 ;
+
+	pthread_mutex_lock( &team->lock );
+	while( 1 ) {
+	   while( team->round == round ) pthread_cond_wait( &team->start, &team->lock );
+	   round = team->round ;
+	   work = team->work ;
+	   pthread_mutex_unlock( &team->lock );
+
+	   segmentThread( work );
+
+	   pthread_mutex_lock( &team->lock );
+	   if( --team->busy == 0 ) pthread_cond_signal( &team->done );
+	   }
+	return( NULL );
+}
+
+/* Takes the segments of a replicate one at a time and mutates them, until there are none left. */
+	void *
+segmentThread( void *arg )
+{
+	struct segmentWork *work = arg ;
+	int k;
+
+	while( (k = __atomic_fetch_add( &work->next, 1, __ATOMIC_RELAXED )) < work->njobs )
+	   mutateSegment( work, work->jobs + k, k );
+	return( NULL );
+}
+
+/* Carries out the current stage of the mutation of segment k, with the substream of the replicate for that
+   segment and stage: 2k+1 to draw its segregating sites, 2k+2 to place them. */
+	void
+mutateSegment( struct segmentWork *work, struct segmentJob *job, int k )
+{
+	void make_gametes(int nsam, int mfreq,  struct node *ptree, double tt, int newsites, int ns, char **list );
+	void ndes_setup( struct node *, int nsam );
+	double ttime(struct node *, int nsam), ttimemf(struct node *, int nsam, int mfreq) ;
+
+	replicateSubstream( work->replicate, 2*k + work->stage );
+	if( work->stage == SEGMENT_SITES ) {
+	   if( work->mfreq > 1 ) ndes_setup( job->ptree, work->nsam );
+	   if( work->mfreq == 1) job->tt = ttime(job->ptree, work->nsam);
+	   else job->tt = ttimemf(job->ptree, work->nsam, work->mfreq );
+	   job->segsit = poisso( job->tseg*job->tt );
+	   }
+	else {
+	   make_gametes(work->nsam, work->mfreq, job->ptree, job->tt, job->segsit, job->ns, work->list );
+	   free(job->ptree) ;
+	   locate(job->segsit, job->beg, job->len, work->posit + job->ns);
+	   }
+}
+
 	void
 ndes_setup(struct node *ptree, int nsam )
 {
@@ -437,9 +613,9 @@ getpars(int argc, char *argv[], int *phowmany, int ntbs, int count )
 			case 'r' :
 				arg++;
 				argcheck( arg, argc, argv);
-				pars.cp.r = atof(  argv[arg++] );
+				pars.cp.r = tbsArgument( argv, arg++, TBS_RHO, 0, 0, NULL );
 				argcheck( arg, argc, argv);
-				pars.cp.nsites = atoi( argv[arg++]);
+				pars.cp.nsites = (int) tbsArgument( argv, arg++, TBS_NSITES, 0, 0, NULL );
 				if( pars.cp.nsites <2 ){
 					fprintf(stderr,"with -r option must specify both rec_rate and nsites>1\n");
 					usage();
@@ -453,9 +629,9 @@ getpars(int argc, char *argv[], int *phowmany, int ntbs, int count )
 			case 'c' :
 				arg++;
 				argcheck( arg, argc, argv);
-				pars.cp.f = atof(  argv[arg++] );
+				pars.cp.f = tbsArgument( argv, arg++, TBS_CONVERSION, 0, 0, NULL );
 				argcheck( arg, argc, argv);
-				pars.cp.track_len = atof( argv[arg++]);
+				pars.cp.track_len = tbsArgument( argv, arg++, TBS_TRACK_LENGTH, 0, 0, NULL );
 				if( pars.cp.track_len <1. ){
 					fprintf(stderr,"with -c option must specify both f and track_len>0\n");
 					usage();
@@ -464,7 +640,7 @@ getpars(int argc, char *argv[], int *phowmany, int ntbs, int count )
 			case 't' :
 				arg++;
 				argcheck( arg, argc, argv);
-				pars.mp.theta = atof(  argv[arg++] );
+				pars.mp.theta = tbsArgument( argv, arg++, TBS_THETA, 0, 0, NULL );
 				break;
 			case 's' :
 				arg++;
@@ -475,7 +651,7 @@ getpars(int argc, char *argv[], int *phowmany, int ntbs, int count )
                     arg += 3;
 				}
 				else {
-				    pars.mp.segsitesin = atoi(  argv[arg++] );
+				    pars.mp.segsitesin = (int) tbsArgument( argv, arg++, TBS_SEGSITES, 0, 0, NULL );
 				}
 				break;
 			case 'F' :
@@ -532,7 +708,7 @@ getpars(int argc, char *argv[], int *phowmany, int ntbs, int count )
 				    for( pop = 0; pop <npop; pop++)
 				      for( pop2 = 0; pop2 <npop; pop2++){
 					     argcheck( arg, argc, argv);
-					     pars.cp.mig_mat[pop][pop2]= atof( argv[arg++] ) ;
+					     pars.cp.mig_mat[pop][pop2]= tbsArgument( argv, arg++, TBS_MIGRATION, pop, pop2, NULL ) ;
 					  }
 				    for( pop = 0; pop < npop; pop++) {
 					  pars.cp.mig_mat[pop][pop] = 0.0 ;
@@ -547,7 +723,7 @@ getpars(int argc, char *argv[], int *phowmany, int ntbs, int count )
 			         argcheck( arg, argc, argv);
 		             j = atoi( argv[arg++] ) -1;
 			         argcheck( arg, argc, argv);
-		             mij = atof( argv[arg++] );
+		             mij = tbsArgument( argv, arg++, TBS_MIGRATION, i, j, NULL );
 		             pars.cp.mig_mat[i][i] += mij -  pars.cp.mig_mat[i][j]  ;
 		             pars.cp.mig_mat[i][j] = mij;
 			    }
@@ -558,7 +734,7 @@ getpars(int argc, char *argv[], int *phowmany, int ntbs, int count )
 			    argcheck( arg, argc, argv);
 			    pop = atoi( argv[arg++] ) -1;
 			    argcheck( arg, argc, argv);
-			    psize = atof( argv[arg++] );
+			    psize = tbsArgument( argv, arg++, TBS_SIZE, pop, 0, NULL );
 			    pars.cp.size[pop] = psize ;
 			   break;
 			case 'g' :
@@ -567,13 +743,13 @@ getpars(int argc, char *argv[], int *phowmany, int ntbs, int count )
 			    argcheck( arg, argc, argv);
 			    pop = atoi( argv[arg++] ) -1;
 			    if( arg >= argc ) { fprintf(stderr,"Not enough arg's after -G.\n"); usage(); }
-			    palpha = atof( argv[arg++] );
+			    palpha = tbsArgument( argv, arg++, TBS_POPULATION_GROWTH, pop, 0, NULL );
 			    pars.cp.alphag[pop] = palpha ;
 			   break;
 			case 'G' :
 			    arg++;
 			    if( arg >= argc ) { fprintf(stderr,"Not enough arg's after -G.\n"); usage(); }
-			    palpha = atof( argv[arg++] );
+			    palpha = tbsArgument( argv, arg++, TBS_GROWTH, 0, 0, NULL );
 			    for( i=0; i<pars.cp.npop; i++)
 			       pars.cp.alphag[i] = palpha ;
 			   break;
@@ -583,7 +759,7 @@ getpars(int argc, char *argv[], int *phowmany, int ntbs, int count )
 			    ch3 = argv[arg][3] ;
 			    arg++;
 			    argcheck( arg, argc, argv);
-			    pt->time = atof( argv[arg++] ) ;
+			    pt->time = tbsArgument( argv, arg++, TBS_EVENT_TIME, 0, 0, pt ) ;
 			    pt->nextde = NULL ;
 			    if( pars.cp.deventlist == NULL )
 				    pars.cp.deventlist = pt ;
@@ -597,39 +773,40 @@ getpars(int argc, char *argv[], int *phowmany, int ntbs, int count )
 			    switch( pt->detype ) {
                     case 'N' :
                           argcheck( arg, argc, argv);
-                          pt->paramv = atof( argv[arg++] ) ;
+                          pt->paramv = tbsArgument( argv, arg++, TBS_EVENT_PARAMETER, 0, 0, pt ) ;
                           break;
                     case 'G' :
                       if( arg >= argc ) { fprintf(stderr,"Not enough arg's after -eG.\n"); usage(); }
-                      pt->paramv = atof( argv[arg++] ) ;
+                      pt->paramv = tbsArgument( argv, arg++, TBS_EVENT_PARAMETER, 0, 0, pt ) ;
                       break;
                     case 'M' :
                         argcheck( arg, argc, argv);
-                        pt->paramv = atof( argv[arg++] ) ;
+                        pt->paramv = tbsArgument( argv, arg++, TBS_EVENT_PARAMETER, 0, 0, pt ) ;
                         break;
                     case 'n' :
                           argcheck( arg, argc, argv);
                       pt->popi = atoi( argv[arg++] ) -1 ;
                           argcheck( arg, argc, argv);
-                      pt->paramv = atof( argv[arg++] ) ;
+                      pt->paramv = tbsArgument( argv, arg++, TBS_EVENT_PARAMETER, 0, 0, pt ) ;
                       break;
                     case 'g' :
                           argcheck( arg, argc, argv);
                       pt->popi = atoi( argv[arg++] ) -1 ;
                       if( arg >= argc ) { fprintf(stderr,"Not enough arg's after -eg.\n"); usage(); }
-                      pt->paramv = atof( argv[arg++] ) ;
+                      pt->paramv = tbsArgument( argv, arg++, TBS_EVENT_PARAMETER, 0, 0, pt ) ;
                       break;
                     case 's' :
                           argcheck( arg, argc, argv);
                       pt->popi = atoi( argv[arg++] ) -1 ;
                           argcheck( arg, argc, argv);
-                      pt->paramv = atof( argv[arg++] ) ;
+                      pt->paramv = tbsArgument( argv, arg++, TBS_EVENT_PARAMETER, 0, 0, pt ) ;
                       break;
                     case 'm' :
                       if( ch3 == 'a' ) {
                          pt->detype = 'a' ;
                          argcheck( arg, argc, argv);
                          npop2 = atoi( argv[arg++] ) ;
+                         pt->popi = npop2 ;	/* unused by the event, keeps the size of the matrix (result cache) */
                          pt->mat = (double **)malloc( (unsigned)npop2*sizeof( double *) ) ;
                          for( pop =0; pop <npop2; pop++){
                            (pt->mat)[pop] = (double *)malloc( (unsigned)npop2*sizeof( double) );
@@ -654,7 +831,7 @@ getpars(int argc, char *argv[], int *phowmany, int ntbs, int count )
                             argcheck( arg, argc, argv);
                             pt->popj = atoi( argv[arg++] ) -1 ;
                             argcheck( arg, argc, argv);
-                            pt->paramv = atof( argv[arg++] ) ;
+                            pt->paramv = tbsArgument( argv, arg++, TBS_EVENT_PARAMETER, 0, 0, pt ) ;
                       }
                       break;
                     case 'j' :
@@ -681,6 +858,7 @@ getpars(int argc, char *argv[], int *phowmany, int ntbs, int count )
         usage();
         exit(1);
     }
+    bindTbsArguments( argc, argv, pars );
 
 	return pars;
 }
@@ -729,6 +907,41 @@ fprintf(stderr,"\t -ej t i j   ( Join lineages in pop i and pop j into pop j\n")
 fprintf(stderr,"\t\t  size, alpha and M are unchanged.\n");
 fprintf(stderr,"\t  -f filename     ( Read command line arguments from file filename.)\n");
 fprintf(stderr,"\t  -p n ( Specifies the precision of the position output.  n is the number of digits after the decimal.)\n");
+fprintf(stderr,"\t  tbs  ( In place of a value: each replicate takes its own, read from stdin in replicate order.\n");
+fprintf(stderr,"\t\t Values of population indices, npop and -ema can't be tbs.)\n");
+fprintf(stderr,"  mspar options: \n");
+fprintf(stderr,"\t --master-works  ( The master process simulates samples too, in between serving the workers.)\n");
+fprintf(stderr,"\t --scheduling policy  ( dynamic: the master assigns work on demand (default).\n");
+fprintf(stderr,"\t\t rma: the workers claim work from a counter shared through MPI one-sided operations.\n");
+fprintf(stderr,"\t\t static: every process generates howmany/processes samples, without scheduling messages.\n");
+fprintf(stderr,"\t\t auto: static or dynamic, chosen after a pilot timing samples on every worker.\n");
+fprintf(stderr,"\t\t With tbs values read from stdin, only dynamic: they are sent along with the work.)\n");
+fprintf(stderr,"\t --output file  ( Writes the output to file, keeping a ledger of it in file.ledger.)\n");
+fprintf(stderr,"\t --checkpoint n  ( Updates the ledger every n replicates, 0 = never. Default 1000.)\n");
+fprintf(stderr,"\t --resume  ( Resumes an interrupted run from the ledger of its --output file.)\n");
+fprintf(stderr,"\t --binary  ( Writes the samples as binary records, which mspar-convert turns into ms output.)\n");
+fprintf(stderr,"\t --replay i  ( Generates replicate i alone (replicates are numbered from 0), as it is in a full run.)\n");
+fprintf(stderr,"\t --speculate  ( Idle workers re-run the work units still running at the end of the run.)\n");
+fprintf(stderr,"\t --threads n  ( Every worker generates the samples of its work units with n threads. Default 1.\n");
+fprintf(stderr,"\t\t mspar-threads, which runs without MPI, generates the samples with n threads. Default: one per core.)\n");
+fprintf(stderr,"\t --segment-threads n  ( Every replicate generates the mutations of its segments with n threads. Default 1.)\n");
+fprintf(stderr,"\t --sweep manifest  ( Generates the parameter sets of the manifest in a single run, instead of nsam howmany\n");
+fprintf(stderr,"\t\t and the ms options. Each line holds a set: output_file nsam howmany [ms options]. A set's output\n");
+fprintf(stderr,"\t\t is the one a run of the set alone, with the same seeds, writes.)\n");
+fprintf(stderr,"\t --abc stats --observed values --tolerance t  ( ABC rejection: every replicate is reduced to the\n");
+fprintf(stderr,"\t\t statistics (comma separated list of pi, ss, D, thetaH, H) and written out as a row of its tbs\n");
+fprintf(stderr,"\t\t values and statistics if their distance to the observed ones, relative to them, is at most t.)\n");
+fprintf(stderr,"\t --prior low:high  ( With --abc, a tbs argument is drawn from a uniform prior instead of read from\n");
+fprintf(stderr,"\t\t stdin. One per tbs argument, in their order.)\n");
+fprintf(stderr,"\t --cache dir  ( Keeps the samples generated in dir, by blocks of 1000 replicates, and serves them\n");
+fprintf(stderr,"\t\t instead of generating them again in any run with the same parameters and seeds.)\n");
+fprintf(stderr,"\t --cache-size MB  ( Size of the cache. Beyond it, the runs used least recently go first, each one\n");
+fprintf(stderr,"\t\t from its last block backwards. Default 1024.)\n");
+fprintf(stderr,"\t --serve socket  ( mspar-threads alone: runs as a service taking its user's jobs on a Unix socket.)\n");
+fprintf(stderr,"\t --connect socket  ( mspar-threads alone: hands the job over to the service listening on socket.)\n");
+fprintf(stderr,"\t --no-shared-memory  ( Workers on the master's node send their results as messages too.)\n");
+fprintf(stderr,"\t --hierarchy node|n  ( Workers are split in groups, one per node or of n processes. Each group is\n");
+fprintf(stderr,"\t\t scheduled by a sub-master that gets large work units from the master.)\n");
 fprintf(stderr," See msdoc.pdf for explanation of these parameters.\n");
 
 exit(1);
@@ -825,62 +1038,52 @@ ttimemf( ptree, nsam, mfreq)
 }
 
 
-	char*
-prtree( ptree, nsam)
+/* Appends the Newick tree of a segment to the trees text. */
+	void
+prtree( ptree, nsam, trees)
 	struct node *ptree;
 	int nsam;
+	struct outputBuffer *trees;
 {
-	double t;
-	int i, *descl, *descr ;
-	char *parens( struct node *ptree, int *descl, int *descr, int noden );
+	int i ;
+	static __thread int *descl, *descr, size ;	/* per simulation thread, grown along with nsam */
+	void parens( struct node *ptree, int *descl, int *descr, int noden, struct outputBuffer *trees );
 
-	descl = (int *)malloc( (unsigned)(2*nsam-1)*sizeof( int) );
-	descr = (int *)malloc( (unsigned)(2*nsam-1)*sizeof( int) );
+	if( size < 2*nsam-1 ) {
+	  size = 2*nsam-1 ;
+	  descl = (int *)realloc( descl, (unsigned)size*sizeof( int) );
+	  descr = (int *)realloc( descr, (unsigned)size*sizeof( int) );
+	}
 	for( i=0; i<2*nsam-1; i++) descl[i] = descr[i] = -1 ;
 	for( i = 0; i< 2*nsam-2; i++){
 	  if( descl[ (ptree+i)->abv ] == -1 ) descl[(ptree+i)->abv] = i ;
 	  else descr[ (ptree+i)->abv] = i ;
 	 }
-	char *result = parens( ptree, descl, descr, 2*nsam-2);
-	free( descl ) ;
-	free( descr ) ;
-
-	return result;
+	parens( ptree, descl, descr, 2*nsam-2, trees);
 }
 
-	char*
-parens( struct node *ptree, int *descl, int *descr,  int noden)
+	void
+parens( struct node *ptree, int *descl, int *descr,  int noden, struct outputBuffer *trees)
 {
 	double time ;
-	char *result = malloc(16);
 
-    if( descl[noden] == -1 )
-	{
-		sprintf(result,"%d:%5.3lf", noden+1, (ptree+ ((ptree+noden)->abv))->time );
-	    //fprintf(stdout, "%d:%5.3lf", noden+1, (ptree+ ((ptree+noden)->abv))->time );
+    if( descl[noden] == -1 ) {
+	  bufferFixed( trees, noden+1, 0, 0 );	/* the tip number, an integer */
+	  bufferAppend( trees, ":", 1 );
+	  bufferFixed( trees, (ptree+ ((ptree+noden)->abv))->time, 5, 3 );
+	}
+	else{
+	  bufferAppend( trees, "(", 1 );
+	  parens( ptree, descl,descr, descl[noden], trees ) ;
+	  bufferAppend( trees, ",", 1 );
+	  parens(ptree, descl, descr, descr[noden], trees ) ;
+	  if( (ptree+noden)->abv == 0 ) bufferAppend( trees, ");\n", 3 );
+	  else {
+	    time = (ptree + (ptree+noden)->abv )->time - (ptree+noden)->time ;
+	    bufferAppend( trees, "):", 2 );
+	    bufferFixed( trees, time, 5, 3 );
+	  }
 	}
-	else
-	{
-		sprintf(result, "(");
-	    //fprintf(stdout, "(");
-	    result = append(result, parens( ptree, descl,descr, descl[noden] ));
-		result = append(result, ",");
-	    //fprintf(stdout, ",");
-	    result = append(result, parens(ptree, descl, descr, descr[noden] )) ;
-        if( (ptree+noden)->abv == 0 )
-		{
-			result = append(result, ");\n");
-            //fprintf(stdout, ");\n");
-		}
-        else {
-          time = (ptree + (ptree+noden)->abv )->time - (ptree+noden)->time ;
-		  char* tempString = malloc(9);
-		  sprintf(tempString, "):%5.3lf", time );
-		  result = append(result, tempString);
-          //fprintf(stdout, "):%5.3lf", time );
-        }
-    }
-	return result;
 }
 
 /***  pickb : returns a random branch from the tree. The probability of picking
@@ -1033,28 +1236,20 @@ poisso(double u)
 }
 
 
-/* a slight modification of crecipes version */
+/* a slight modification of crecipes version. The second deviate is not kept for the next call, as it would
+   carry over from one replicate to another and every replicate must depend on its own random stream alone. */
 
 double gasdev(m,v)
 	double m, v;
 {
-	static int iset=0;
-	static float gset;
 	float fac,r,v1,v2;
 	double ran1();
 
-	if  (iset == 0) {
-		do {
-			v1=2.0*ran1()-1.0;
-			v2=2.0*ran1()-1.0;
-			r=v1*v1+v2*v2;
-		} while (r >= 1.0);
-		fac=sqrt(-2.0*log(r)/r);
-		gset= v1*fac;
-		iset=1;
-		return( m + sqrt(v)*v2*fac);
-	} else {
-		iset=0;
-		return( m + sqrt(v)*gset ) ;
-	}
+	do {
+		v1=2.0*ran1()-1.0;
+		v2=2.0*ran1()-1.0;
+		r=v1*v1+v2*v2;
+	} while (r >= 1.0);
+	fac=sqrt(-2.0*log(r)/r);
+	return( m + sqrt(v)*v2*fac);
 }
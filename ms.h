@@ -45,7 +45,7 @@ struct node{
 struct gensam_result {
 	// positions of the segregating sites (on a scale of 0.0 - 1.0)
 	double 	*positions;
-	// tree output
+	// tree output, in the simulating thread's buffer until its next sample
 	char	*tree;
 };
 
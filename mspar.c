@@ -4,43 +4,103 @@ const int SEEDS_COUNT = 3;
 const int SEED_TAG = 100;
 const int SAMPLES_NUMBER_TAG = 200;
 const int RESULTS_TAG = 300;
-const int GO_TO_WORK_TAG = 400;
+const int SHUTDOWN_TAG = 400;
+const int REPORT_TAG = 500;
+const int CANCEL_TAG = 700;
+const int RELEASE_TAG = 800;
+const int TBS_TAG = 900;
+
+// Work units queued at every worker (the one being simulated plus the prefetched ones)
+const int PREFETCH_DEPTH = 2;
+
+// Work unit sizing (guided self-scheduling / factoring)
+const int CHUNK_FACTOR = 2;                 // each round hands out 1/CHUNK_FACTOR of the remaining samples
+const int FIRST_CHUNK_LIMIT = 1024;         // upper bound while the worker's latency is still unknown
+const double CHUNK_BYTES_LIMIT = 64 << 20;  // upper bound on the results size of a single work unit
+const double LATENCY_WEIGHT = 0.5;          // weight of the newest measurement in the latency average
+const double SAMPLE_SIZE_WEIGHT = 0.5;      // weight of the newest measurement in the sample size average
+
+// Copies of a work unit running at the same time when speculating at the tail of a run (the original included)
+const int SPECULATIVE_COPIES = 2;
+
+// Results are sent in fragments of at most this many bytes, so no side holds a whole work unit to transfer it
+const int FRAGMENT_SIZE = 4 << 20;
+
+// Results arriving ahead of their turn are held in memory up to this many bytes, and spilled to disk beyond it
+const double REORDER_MEMORY_LIMIT = 256 << 20;
+
+// Samples each simulation thread of a worker may generate ahead of the ones already sent (--threads)
+const int TEAM_WINDOW_PER_THREAD = 2;
+
+// Automatic scheduling policy selection. Static scheduling is chosen when the slowest static block is expected to
+// take at most STATIC_IMBALANCE_LIMIT longer than the average one: beyond that, the idle time at the end of the run
+// costs more than the scheduling messages dynamic scheduling needs.
+const double STATIC_IMBALANCE_LIMIT = 0.05; // highest expected load imbalance accepted for static scheduling
+const int PILOT_MIN_SAMPLES = 16;           // fewest samples timed before choosing
+const double PILOT_MAX_FRACTION = 0.1;      // largest part of the run the pilot may take
+const double PILOT_CONFIDENCE = 2.0;        // standard errors the estimate must be away from the limit to choose
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 #include <assert.h>
 #include <string.h>
+#include <unistd.h>
 #include "ms.h"
 #include "mspar.h"
-#include <mpi.h> /* OpenMPI library */
+
+// Window exposing the shared sample counter when the workers claim their own work (RMA scheduling)
+static MPI_Win counterWindow = MPI_WIN_NULL;
+
+// Communicators of the scheduling hierarchy (--hierarchy); both remain MPI_COMM_NULL without it
+static MPI_Comm upperComm = MPI_COMM_NULL;  // the master and the sub-masters
+static MPI_Comm groupComm = MPI_COMM_NULL;  // a sub-master (rank 0) and the workers of its group
+
+// Output buffers shared between the workers and their master when they run on the same node (createSharedOutputs)
+static MPI_Win reportWindow = MPI_WIN_NULL;     // window of the communicator this process reports to
+static char *sharedOutputs = NULL;              // this process' two output buffers in it (NULL = results go by message)
+static MPI_Win scheduleWindow = MPI_WIN_NULL;   // window of the communicator this process schedules
+static char **workersOutputs = NULL;            // output buffers of its workers, by rank (NULL entry = by message)
+
+// First replicate generated by this run: 0, unless resuming an interrupted one
+static int firstReplicate = 0;
+
+// Simulation threads of this worker (NULL = it generates its samples alone)
+static struct threadTeam *workerTeam = NULL;
 
 // **************************************  //
 // MASTER
 // **************************************  //
 
 int
-masterWorkerSetup(int argc, char *argv[], int howmany, struct params parameters)
+masterWorkerSetup(int argc, char *argv[], int howmany, struct params parameters, struct msparOptions options)
 {
     // myRank           : rank of the current process in the MPI ecosystem.
     // poolSize         : number of processes in the MPI ecosystem.
-    // goToWork         : used by workers to realize if there is more work to do.
-    // seedMatrix       : matrix containing the RNG seeds to be distributed to working processes.
-    // localSeedMatrix  : matrix used by workers to receive RNG seeds from master.
+    // seeds            : RNG seeds every replicate's stream is keyed by, distributed by the master.
+    // threadSupport    : thread support level provided by the MPI library.
     int myRank;
     int poolSize;
-    unsigned short *seedMatrix;
-    unsigned short localSeedMatrix[3];
+    int threadSupport;
+    unsigned short seeds[SEEDS_COUNT];
 
 
-    // MPI Initialization
-    MPI_Init(&argc, &argv );
+    // MPI Initialization. Only the main thread of a process makes MPI calls, simulation threads never do.
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &threadSupport);
     MPI_Comm_size(MPI_COMM_WORLD, &poolSize);
     MPI_Comm_rank(MPI_COMM_WORLD, &myRank);
+    if(options.threads > 1 && threadSupport < MPI_THREAD_FUNNELED)
+    {
+        if(myRank == 0) fprintf(stderr, " the MPI library does not support threads, --threads is ignored\n");
+        options.threads = 1;
+    }
 
     if(myRank == 0)
     {
         int i;
+        if(options.output != NULL) openOutput(options);
+        beginHeader(options);
+
         // Only the master process prints out the application's parameters
         for(i=0; i<argc; i++)
         {
@@ -54,29 +114,59 @@ masterWorkerSetup(int argc, char *argv[], int howmany, struct params parameters)
             poolSize = howmany + 1; // the extra 1 is due to the master
         }
 
-        int nseeds;
+        int nseeds = SEEDS_COUNT;
         doInitializeRng(argc, argv, &nseeds, parameters);
-        int dimension = nseeds * poolSize;
-        seedMatrix = (unsigned short *) malloc(sizeof(unsigned short) * dimension);
-        for(i=0; i<dimension;i++)
-        {
-          seedMatrix[i] = (unsigned short) (ran1()*100000);
-        }
+        endHeader();
+        getStreamsKey(seeds);
+        if(options.output != NULL && options.replay < 0) firstReplicate = openLedger(options, howmany, seeds);
     }
 
-    // Filter out workers with rank higher than howmany, meaning there are more workers than samples to be generated.
-    if(myRank <= howmany)
+    // Every process generates any replicate from the same stream, so they all share the seeds.
+    MPI_Bcast(seeds, SEEDS_COUNT, MPI_UNSIGNED_SHORT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&firstReplicate, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    parallelSeed(seeds);
+    // The master reads the tbs values as it hands the work units out, and sends them along with every unit
+    if(myRank == 0 && tbsFromInput()) openTbs(stdin);
+    if(options.cache != NULL && options.replay < 0)
     {
-        MPI_Scatter(seedMatrix, 3, MPI_UNSIGNED_SHORT, localSeedMatrix, 3, MPI_UNSIGNED_SHORT, 0, MPI_COMM_WORLD);
-        if(myRank == 0)
-        {
-            // Master Processing
-            masterProcessingLogic(howmany, 0, poolSize);
-        } else
-        {
-            // Worker Processing
-            parallelSeed(localSeedMatrix);
-        }
+        if(myRank == 0) firstReplicate = openCache(options, howmany, firstReplicate, parameters, seeds);
+        MPI_Bcast(&firstReplicate, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    }
+    if(myRank == 0) releaseTbs(firstReplicate);
+
+    if(options.scheduling == RMA_SCHEDULING)
+    {
+        createSampleCounter(myRank);
+    }
+    if(options.groupSize != 0)
+    {
+        createHierarchy(myRank, howmany, options.groupSize);
+        if(myRank == 0) MPI_Comm_size(upperComm, &poolSize);
+    }
+    if(options.sharedMemory)
+    {
+        if(options.groupSize == 0) createSharedOutputs(MPI_COMM_WORLD);
+        if(upperComm != MPI_COMM_NULL) createSharedOutputs(upperComm);
+        if(groupComm != MPI_COMM_NULL) createSharedOutputs(groupComm);
+    }
+
+    if(myRank == 0)
+    {
+        // Master Processing
+        if(poolSize == 1) options.masterWorks = 1; // nobody else to do the work
+        if(options.replay >= 0)
+            generateMasterSample(NULL, options.replay, parameters);
+        else if(options.scheduling == RMA_SCHEDULING)
+            masterOutputLogic(howmany, poolSize, parameters, options);
+        else if(options.scheduling == STATIC_SCHEDULING)
+            masterStaticLogic(howmany - firstReplicate, poolSize, parameters, options);
+        else if(options.scheduling == AUTO_SCHEDULING)
+            masterAutoLogic(howmany - firstReplicate, poolSize, parameters, options);
+        else
+            masterProcessingLogic(howmany - firstReplicate, 0, poolSize,
+                                  upperComm != MPI_COMM_NULL ? upperComm : MPI_COMM_WORLD, parameters, options);
+
+        if(options.output != NULL && options.replay < 0) writeLedger(howmany);
     }
 
     return myRank;
@@ -84,367 +174,1793 @@ masterWorkerSetup(int argc, char *argv[], int howmany, struct params parameters)
 
 void
 masterWorkerTeardown() {
+    if(counterWindow != MPI_WIN_NULL)
+    {
+        MPI_Win_unlock_all(counterWindow);
+        MPI_Win_free(&counterWindow);
+    }
+    if(reportWindow != MPI_WIN_NULL)
+    {
+        MPI_Win_unlock_all(reportWindow);
+        MPI_Win_free(&reportWindow);
+    }
+    if(scheduleWindow != MPI_WIN_NULL)
+    {
+        MPI_Win_unlock_all(scheduleWindow);
+        MPI_Win_free(&scheduleWindow);
+    }
+    free(workersOutputs);
+    if(upperComm != MPI_COMM_NULL) MPI_Comm_free(&upperComm);
+    if(groupComm != MPI_COMM_NULL) MPI_Comm_free(&groupComm);
+    closeLedger();
+    closeCache();
     MPI_Finalize();
 }
 
+/* Aborts the run on every process, after an error that leaves it without a way to go on. */
+void
+abortRun()
+{
+    MPI_Abort(MPI_COMM_WORLD, 1);
+}
+
 /*
- * Lógica de procesamiento del MASTER
+ * Splits the processes into a two level scheduling hierarchy. The workers (every process but the master) are split
+ * into groups, either one per node or of groupSize consecutive ranks. The lowest rank of every group becomes its
+ * sub-master: it gets large work units from the master through upperComm and schedules them among the workers of
+ * its group through groupComm.
  *
- * @param howmany la cantidad total de muestras a generar
- * @param lastAssignedWorker último worker al que se le asignó trabajo.
- * @param poolSize la cantidad de workers (incluido el master) que hay
+ * This is a collective call: every process in MPI_COMM_WORLD has to make it.
  *
+ * @param myRank rank of the current process
+ * @param howmany replicates of the run
+ * @param groupSize processes per group, or NODE_GROUPS for one group per node
  */
 void
-masterProcessingLogic(int howmany, int lastAssignedWorker, int poolSize)
+createHierarchy(int myRank, int howmany, int groupSize)
 {
-    int *workersActivity = (int*) malloc(poolSize * sizeof(int));
-    workersActivity[0] = 1; // Master is always busy
-    int i;
-    for(i=1; i<poolSize; i++)   workersActivity[i] = 0;
+    MPI_Comm workersComm;
+    int groupRank = 1;
 
-    // pendingJobs: utilizado para contabilidad el número de jobs ya asignados pendientes de respuesta por los workers.
-    int pendingJobs = howmany;
-
-    while(howmany > 0)
+    // Processes filtered out by masterWorkerSetup do not take part of the hierarchy.
+    MPI_Comm_split(MPI_COMM_WORLD, myRank > 0 && myRank <= howmany ? 1 : MPI_UNDEFINED, myRank, &workersComm);
+    if(workersComm != MPI_COMM_NULL)
     {
-        int idleWorker = findIdleWorker(workersActivity, poolSize, lastAssignedWorker);
-        if(idleWorker > 0)
-        {
-          assignWork(workersActivity, idleWorker, 1);
-          lastAssignedWorker = idleWorker;
-          howmany--;
-        }
+        int workersRank;
+        MPI_Comm_rank(workersComm, &workersRank);
+        if(groupSize == NODE_GROUPS)
+            MPI_Comm_split_type(workersComm, MPI_COMM_TYPE_SHARED, workersRank, MPI_INFO_NULL, &groupComm);
         else
-        {
-          readResultsFromWorkers(1, workersActivity);
-          pendingJobs--;
-        }
-    }
-    while(pendingJobs > 0)
-    {
-        readResultsFromWorkers(0, workersActivity);
-        pendingJobs--;
+            MPI_Comm_split(workersComm, workersRank / groupSize, workersRank, &groupComm);
+        MPI_Comm_rank(groupComm, &groupRank);
+        MPI_Comm_free(&workersComm);
     }
+
+    MPI_Comm_split(MPI_COMM_WORLD, myRank == 0 || groupRank == 0 ? 1 : MPI_UNDEFINED, myRank, &upperComm);
 }
 
 /*
+ * Places the output buffers of the workers running on their master's node in a shared memory window, so they write
+ * their results where the master reads them: only the reports travel as messages. Workers on other nodes keep
+ * sending their results.
  *
- * Esta función realiza dos tareas: por un lado hace que el Master escuche los resultados enviados por los workers y por
- * otro lado, se envía al worker que se ha recibido la información un mensaje sobre si debe seguir esperando por
- * trabajos o si ha de finalizar su contribución al sistema.
+ * Every worker gets two buffers, one per output of its double buffering, of FRAGMENT_SIZE bytes plus the
+ * terminating null, which streamResults never exceeds. The window is under a passive target epoch that lasts until
+ * masterWorkerTeardown.
  *
- * @param goToWork indica si el worker queda en espera de más trabajo (1) o si ya puede finalizar su ejecución (0)
- * @param workersActivity el vector con el estado de actividad de los workers
- * @return
+ * This is a collective call: every process in comm has to make it.
  *
+ * @param comm communicator whose rank 0 is the master of the rest
  */
-void readResultsFromWorkers(int goToWork, int* workersActivity)
+void
+createSharedOutputs(MPI_Comm comm)
 {
-    MPI_Status status;
-    int size;
-    int source;
+    MPI_Comm nodeComm;
+    MPI_Win window;
+    char *base;
+    int i, rank, size, master, masterNode;
 
-    MPI_Probe(MPI_ANY_SOURCE, RESULTS_TAG, MPI_COMM_WORLD, &status);
-    MPI_Get_count(&status, MPI_CHAR, &size);
-    source = status.MPI_SOURCE;
-    char * results = (char *) malloc(size*sizeof(char));
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &nodeComm);
 
-    MPI_Recv(results, size, MPI_CHAR, source, RESULTS_TAG, MPI_COMM_WORLD, &status);
-    source = status.MPI_SOURCE;
-    MPI_Send(&goToWork, 1, MPI_INT, source, GO_TO_WORK_TAG, MPI_COMM_WORLD);
+    master = rank == 0;
+    MPI_Allreduce(&master, &masterNode, 1, MPI_INT, MPI_MAX, nodeComm);
+    if(masterNode)
+    {
+        MPI_Win_allocate_shared(master ? 0 : 2 * (FRAGMENT_SIZE + 1), 1, MPI_INFO_NULL, nodeComm, &base, &window);
+        MPI_Win_lock_all(MPI_MODE_NOCHECK, window);
+        if(master)
+        {
+            MPI_Group group, nodeGroup;
+            MPI_Comm_group(comm, &group);
+            MPI_Comm_group(nodeComm, &nodeGroup);
 
-    workersActivity[source]=0;
-    fprintf(stdout, "%s", results);
-    free(results);
+            scheduleWindow = window;
+            workersOutputs = (char **) calloc(size, sizeof(char *));
+            for(i=1; i<size; i++)
+            {
+                int nodeRank, unit;
+                MPI_Aint segmentSize;
+                MPI_Group_translate_ranks(group, 1, &i, nodeGroup, &nodeRank);
+                if(nodeRank != MPI_UNDEFINED)
+                    MPI_Win_shared_query(window, nodeRank, &segmentSize, &unit, &workersOutputs[i]);
+            }
+            MPI_Group_free(&group);
+            MPI_Group_free(&nodeGroup);
+        }
+        else
+        {
+            reportWindow = window;
+            sharedOutputs = base;
+        }
+    }
+    MPI_Comm_free(&nodeComm);
 }
 
 /*
- * Función que dada una lista workers, devuelve el índice de esta lista que corresponde a
- * un worker ocioso.
+ * Creates the window holding the shared sample counter. The counter lives in the master's memory and is only
+ * accessed through atomic operations, under a passive target epoch that lasts until masterWorkerTeardown.
  *
- * @param workersActivity estado de actividad de los workers (0=ocioso; 1=ocupado)
- * @param poolSize el largo de la lista de workers
- * @lastAssignedWorker el índice del último worker al que se le asignó tareas
+ * This is a collective call: every process in MPI_COMM_WORLD has to make it.
  *
- * @return en caso de encontrar un worker ocioso, se devuelve su índice de la lista de workers.
- *         En caso contrario se devuelve -1, lo cual significa que todos los workers están ocupados.
+ * @param myRank rank of the current process
  */
-int findIdleWorker(int* workersActivity, int poolSize, int lastAssignedWorker) {
-  /*
-   * Nota, el valor de lastIdleWorker se utiliza para dar oportunidad de ocupación a todos los
-   * workers. De otra forma habría que siempre comenzar desde 0, lo cual puede implicar que
-   * solamente los workers con menor índice sean los que siempre estén ocupados.
-   */
+void
+createSampleCounter(int myRank)
+{
+    int *counter;
+    MPI_Aint size = myRank == 0 ? sizeof(int) : 0;
 
-  int result = -1;
-  int i=lastAssignedWorker+1;
-  while(i < poolSize && workersActivity[i] == 1){
-    i++;
-  };
+    MPI_Win_allocate(size, sizeof(int), MPI_INFO_NULL, MPI_COMM_WORLD, &counter, &counterWindow);
+    if(myRank == 0) *counter = firstReplicate;
+    MPI_Barrier(MPI_COMM_WORLD); // nobody claims samples before the counter is initialized
+    MPI_Win_lock_all(0, counterWindow);
+}
 
-  if(i >= poolSize){
-    i=1; // El proceso 0 es el master, por lo que no se cuenta.
-    while(i < lastAssignedWorker && workersActivity[i]==1){
-      i++;
-    }
+/*
+ * Claims the next block of samples from the shared counter.
+ *
+ * The block size follows the same factoring rule than computeChunkSize, estimated from the counter value seen in
+ * the previous claim, and bounded so the results do not exceed CHUNK_BYTES_LIMIT bytes.
+ *
+ * @param howmany replicates of the run
+ * @param workers number of processes claiming samples
+ * @param claimed counter value after the previous claim of this process; updated with the current one
+ * @param sampleSize measured bytes per sample of this process (0 = not measured yet)
+ *
+ * @return samples to be generated, or 0 if all of them were already claimed
+ */
+int
+claimWorkUnit(int howmany, int workers, int *claimed, double sampleSize)
+{
+    int first;
+    double chunk = ceil((double) (howmany - *claimed) / (CHUNK_FACTOR * workers));
 
-    if(i <= lastAssignedWorker && workersActivity[i]==0){
-      result = i;
-    }
-  } else {
-    result = i;
-  }
+    if(chunk > FIRST_CHUNK_LIMIT) chunk = FIRST_CHUNK_LIMIT;
+    if(sampleSize > 0.0 && chunk * sampleSize > CHUNK_BYTES_LIMIT) chunk = CHUNK_BYTES_LIMIT / sampleSize;
+    if(chunk < 1) chunk = 1;
 
-  return result;
+    *claimed = claimSamples(howmany, (int) chunk, &first);
+    return *claimed - first;
 }
 
 /*
- * Assigns samples to the workers. This implies to send the number of samples to be generated..
+ * Atomically advances the shared counter by the given number of samples.
  *
- * @param workersActivity worker's state (0=idle; 1=busy)
- * @param worker worker's index to whom a sample is going to be assigned
- * @param samples samples the worker is going to generate
+ * @param howmany replicates of the run
+ * @param samples samples to be claimed
+ * @param first where the index of the first claimed sample is stored
+ *
+ * @return the index following the last claimed sample (not greater than howmany)
  */
-void assignWork(int* workersActivity, int worker, int samples) {
-  MPI_Send(&samples, 1, MPI_INT, worker, SAMPLES_NUMBER_TAG, MPI_COMM_WORLD);
- //TODO check usage of MPI_Sendv??
-  workersActivity[worker]=1;
-}
-
-// **************************************  //
-// WORKERS
-// **************************************  //
-
 int
-workerProcess(int myRank, struct params parameters, int maxsites)
+claimSamples(int howmany, int samples, int *first)
 {
-    char *append(char *lhs, const char *rhs);
+    MPI_Fetch_and_op(&samples, first, MPI_INT, 0, 0, MPI_SUM, counterWindow);
+    MPI_Win_flush(0, counterWindow);
 
-    int samples;
-    char *results;
-    char *singleResult;
-    samples = receiveWorkRequest();
-    results = generateSample(parameters, maxsites);
-    samples--;
+    if(*first >= howmany) *first = howmany;
+    return *first + samples > howmany ? howmany : *first + samples;
+}
+
+/*
+ * Master's logic with RMA scheduling: the workers claim their samples from the shared counter, so the master only
+ * receives the results and prints them.
+ *
+ * @param howmany samples to be generated
+ * @param poolSize number of processes, the master included
+ * @param parameters simulation parameters, used when the master works too
+ * @param options mspar's command line options
+ */
+void
+masterOutputLogic(int howmany, int poolSize, struct params parameters, struct msparOptions options)
+{
+    struct workersPool *pool = createWorkersPool(poolSize, MPI_COMM_WORLD);
+    int done = 0, claimed = 0, first;
 
-    while(samples > 0)
+    while(done < howmany - firstReplicate)
     {
-        singleResult = generateSample(parameters, maxsites);
-        samples--;
-        results = append(results, singleResult);
+        if(options.masterWorks && claimed < howmany)
+        {
+            done += pollResultsFromWorkers(pool);
+            claimed = claimSamples(howmany, 1, &first);
+            if(claimed > first)
+            {
+                generateMasterSample(pool, first, parameters);
+                done++;
+            }
+        }
+        else
+        {
+            done += readResultsFromWorkers(pool);
+        }
     }
 
-    sendResultsToMasterProcess(results);
-
-    free(results); // prevent memory leaks
-    return isThereMoreWork();
+    destroyWorkersPool(pool);
 }
 
 /*
- * Receives the sample's quantity the Master process asked to be generated.
+ * Master's logic with static scheduling: every process generates a fixed block of samples, which it works out by
+ * itself, so the master sends no scheduling messages and only receives the results and prints them.
  *
- * @return samples to be generated
+ * @param howmany samples to be generated
+ * @param poolSize number of processes, the master included
+ * @param parameters simulation parameters, used when the master works too
+ * @param options mspar's command line options
  */
-int receiveWorkRequest(){
-  int samples;
-  MPI_Status status;
-
-  MPI_Recv(&samples, 1, MPI_INT, 0, SAMPLES_NUMBER_TAG, MPI_COMM_WORLD, &status);
-  return samples;
-}
-
-int isThereMoreWork() {
-    int goToWork;
-    MPI_Status status;
+void
+masterStaticLogic(int howmany, int poolSize, struct params parameters, struct msparOptions options)
+{
+    struct workersPool *pool = createWorkersPool(poolSize, MPI_COMM_WORLD);
+    int masterBlock = 0;
 
-    MPI_Recv(&goToWork, 1, MPI_INT, 0, GO_TO_WORK_TAG, MPI_COMM_WORLD, &status);
+    if(options.masterWorks) masterBlock = staticBlockSize(howmany, poolSize, 0);
+    collectBlocks(pool, howmany, firstReplicate, masterBlock, parameters);
 
-    return goToWork;
+    destroyWorkersPool(pool);
 }
 
 /*
- * Logic to generate a sample.
+ * Master's logic with the scheduling chosen automatically.
  *
- * @param samples samples to be generated
+ * A pilot phase times single sample units, one per worker and round, so it grows with the number of workers. After
+ * every round the expected imbalance of a static partition of the rest of the samples is estimated as the spread of
+ * the slowest of the blocks, cv * sqrt(2 ln(blocks) / block), along with its standard error. The pilot goes on until
+ * the estimate is PILOT_CONFIDENCE standard errors away from STATIC_IMBALANCE_LIMIT, once at least PILOT_MIN_SAMPLES
+ * samples were timed: below the limit the rest of the samples are split in static blocks, sent with a single message
+ * per worker, and above it they are scheduled dynamically. A pilot that can not tell within PILOT_MAX_FRACTION of the
+ * run falls back to dynamic scheduling, which never does much worse.
  *
- * @return the sample generated by the worker
+ * @param howmany samples to be generated
+ * @param poolSize number of processes, the master included
+ * @param parameters simulation parameters, used when the master works too
+ * @param options mspar's command line options
  */
-char*
-generateSample(struct params parameters, unsigned maxsites)
+void
+masterAutoLogic(int howmany, int poolSize, struct params parameters, struct msparOptions options)
 {
-    struct gensam_result gensam(char **gametes, double *probss, double *ptmrca, double *pttot, struct params pars, int* segsites);
-    char *doPrintWorkerResultHeader(int segsites, double probss, struct params paramters, char *results);
-    char *doPrintWorkerResultPositions(int segsites, int output_precision, double *posit, char *results);
-
-    char *doPrintWorkerResultGametes(int segsites, int nsam, char **gametes, char *results);
-    int segsites;
-    double probss, tmrca, ttot;
-    char *results;
-    char **gametes;
-    double *positions;
-    struct gensam_result gensamResults;
+    struct workersPool *pool = createWorkersPool(poolSize, MPI_COMM_WORLD);
+    int i, workers = poolSize - 1, pending, pilot = 0, budget = howmany * PILOT_MAX_FRACTION;
+    double imbalance, error;
 
-    if( parameters.mp.segsitesin ==  0 )
-        gametes = cmatrix(parameters.cp.nsam,maxsites+1);
-    else
-        gametes = cmatrix(parameters.cp.nsam, parameters.mp.segsitesin+1 );
+    while(workers > 0 && pilot + workers <= budget)
+    {
+        for(i=1, pending = 0; i<poolSize; i++, pending++) assignWork(pool, i, 1);
+        pilot += workers;
+        howmany -= workers;
+        while(pending > 0) pending -= readResultsFromWorkers(pool);
+        if(pool->timedUnits < PILOT_MIN_SAMPLES) continue;
 
-    gensamResults = gensam(gametes, &probss, &tmrca, &ttot, parameters, &segsites);
-    positions = gensamResults.positions;
+        imbalance = staticImbalance(pool, howmany, options.masterWorks, &error);
+        if(imbalance - PILOT_CONFIDENCE * error > STATIC_IMBALANCE_LIMIT) break;
+        if(imbalance + PILOT_CONFIDENCE * error > STATIC_IMBALANCE_LIMIT) continue;
 
-    results = doPrintWorkerResultHeader(segsites, probss, parameters, gensamResults.tree);
-    if(segsites > 0)
-    {
-        results = doPrintWorkerResultPositions(segsites, parameters.output_precision, positions, results);
-        results = doPrintWorkerResultGametes(segsites, parameters.cp.nsam, gametes, results);
-        free(gensamResults.positions);
-        if( parameters.mp.timeflag ) {
-            free(gensamResults.tree);
+        int participants = options.masterWorks ? poolSize : workers;
+        int first = pool->assigned; // the blocks follow the pilot's replicates
+        for(i=1; i<poolSize; i++)
+        {
+            int index = options.masterWorks ? i : i - 1;
+            assignBlock(pool, i, first + staticBlockStart(howmany, participants, index),
+                        staticBlockSize(howmany, participants, index));
         }
+        collectBlocks(pool, howmany, first, options.masterWorks ? staticBlockSize(howmany, participants, 0) : 0,
+                      parameters);
+        howmany = 0;
+        break;
     }
+    scheduleSamples(pool, howmany, parameters, options);
 
-    return results;
+    shutdownWorkers(pool);
+    destroyWorkersPool(pool);
 }
 
-
 /*
- * Prints the number of segregation sites:
- *    \n
- *    // xxx.x xx.xx x.xxxx x.xxxx
- *    segsites: xxx
+ * Estimates the load imbalance a static partition of the samples would have, from the times per sample measured
+ * so far: the relative deviation of the slowest block from the mean, cv * sqrt(2 ln(blocks) / samples per block).
+ * Its standard error follows from the one of the coefficient of variation cv of n times, cv * sqrt((1 + 2 cv^2) / 2n).
+ *
+ * @param pool the workers' bookkeeping, with the times measured so far
+ * @param howmany samples to be split in blocks
+ * @param masterWorks 1 if the master gets a block too
+ * @param error where the standard error of the estimate is stored
+ *
+ * @return the expected imbalance, as a fraction of the block time
  */
-char *doPrintWorkerResultHeader(int segsites, double probss, struct params pars, char *treeOutput){
-    char *tempString;
+double
+staticImbalance(struct workersPool *pool, int howmany, int masterWorks, double *error)
+{
+    int blocks = masterWorks ? pool->size : pool->size - 1;
+    double mean, variance, cv, block = (double) howmany / blocks;
+
+    *error = 0.0;
+    if(pool->timedUnits < 2 || blocks < 2) return 0.0;
+    mean = pool->elapsedSum / pool->timedUnits;
+    variance = (pool->elapsedSquares - pool->timedUnits * mean * mean) / (pool->timedUnits - 1);
+    if(mean <= 0.0 || variance <= 0.0) return 0.0;
 
-    char *results = malloc(4);
-    sprintf(results, "\n//");
+    cv = sqrt(variance) / mean;
+    *error = cv * sqrt((1 + 2 * cv * cv) / (2.0 * pool->timedUnits)) * sqrt(2 * log(blocks) / block);
+    return cv * sqrt(2 * log(blocks) / block);
+}
+
+/*
+ * Receives the results of statically partitioned samples. When the master works too, it simulates its own block
+ * one sample at a time and polls the workers' reports in between.
+ *
+ * @param pool the workers pool
+ * @param howmany samples to be received, those of the master's block included
+ * @param masterFirst replicate id of the first sample of the master's block
+ * @param masterBlock samples the master has to simulate itself
+ * @param parameters simulation parameters, used when the master works too
+ */
+void
+collectBlocks(struct workersPool *pool, int howmany, int masterFirst, int masterBlock, struct params parameters)
+{
+    int done = 0;
 
-    if( (segsites > 0 ) || ( pars.mp.theta > 0.0 ) ) {
-        if( pars.mp.treeflag ) {
-            results = append(results, treeOutput);
-        } else {
-            results = append(results, "\n");
+    while(done < howmany)
+    {
+        if(masterBlock > 0)
+        {
+            done += pollResultsFromWorkers(pool);
+            generateMasterSample(pool, masterFirst++, parameters);
+            masterBlock--;
+            done++;
         }
-        if( (pars.mp.segsitesin > 0 ) && ( pars.mp.theta > 0.0 )) {
-            asprintf(&tempString, "prob: %g\n", probss);
-            results = append(results, tempString);
+        else
+        {
+            done += readResultsFromWorkers(pool);
         }
-        asprintf(&tempString, "segsites: %d\n",segsites);
-        results = append(results, tempString);
     }
-
-    return results;
 }
 
 /*
- * Prints the segregation site positions:
- *      positions: 0.xxxxx 0.xxxxx .... etc.
+ * Size of the block of a process when the samples are statically partitioned. The first howmany % participants
+ * processes get one extra sample.
+ *
+ * @param howmany samples to be partitioned
+ * @param participants processes taking part in the partition
+ * @param index position of the process among the participants
+ *
+ * @return samples in the process' block
  */
-char *doPrintWorkerResultPositions(int segsites, int output_precision, double *positions, char *results){
-    int i;
-    char tempString[3 + output_precision]; //number+decimal point+space
+int
+staticBlockSize(int howmany, int participants, int index)
+{
+    return howmany / participants + (index < howmany % participants ? 1 : 0);
+}
 
-    results = append(results, "positions: ");
+/*
+ * Replicate id of the first sample in the block of a process when the samples are statically partitioned, relative
+ * to the first sample partitioned.
+ *
+ * @param howmany samples to be partitioned
+ * @param participants processes taking part in the partition
+ * @param index position of the process among the participants
+ *
+ * @return offset of the process' block
+ */
+int
+staticBlockStart(int howmany, int participants, int index)
+{
+    int extra = howmany % participants;
 
-    for(i=0; i<segsites; i++){
-        sprintf(tempString, "%6.*lf ", output_precision, positions[i]);
-        results = append(results, tempString);
-    }
-    return append(results, tempString);
+    return index * (howmany / participants) + (index < extra ? index : extra);
 }
 
 /*
- * Prints the gametes
+ * Lógica de procesamiento del MASTER
+ *
+ * @param howmany la cantidad total de muestras a generar
+ * @param lastAssignedWorker último worker al que se le asignó trabajo.
+ * @param poolSize la cantidad de workers (incluido el master) que hay
+ * @param comm communicator shared with the workers, where the master is rank 0
+ * @param parameters simulation parameters, used when the master works too
+ * @param options mspar's command line options
+ *
  */
-char *doPrintWorkerResultGametes(int segsites, int nsam, char **gametes, char *results){
-    int i;
-    char tempString[segsites+1]; //segsites + LF/CR
-
-    results = append(results, "\n");
+void
+masterProcessingLogic(int howmany, int lastAssignedWorker, int poolSize, MPI_Comm comm, struct params parameters, struct msparOptions options)
+{
+    struct workersPool *pool = createWorkersPool(poolSize, comm);
 
-    for(i=0;i<nsam; i++) {
-        sprintf(tempString, "%s\n", gametes[i]);
-        results = append(results, tempString);
-    }
+    pool->lastAssigned = lastAssignedWorker;
+    scheduleSamples(pool, howmany, parameters, options);
 
-    return results;
+    fflush(stdout); // the output is complete, whatever speculative copies are still running
+    shutdownWorkers(pool);
+    destroyWorkersPool(pool);
 }
 
 /*
- * Sent Worker's results to the Master process.
+ * Distributes samples among the workers of a pool and collects their results.
+ *
+ * Samples are handed out in work units whose size shrinks as the run progresses (see computeChunkSize). Every worker
+ * is kept PREFETCH_DEPTH units ahead, so it finds its next unit already queued when it reports the current one. The
+ * reports are received through receive requests posted in advance for every worker and completed with MPI_Waitany.
  *
- * @param results results to be sent
+ * When the master works too, it simulates one sample at a time and polls the workers' reports in between, so a
+ * worker never waits on the master longer than a single sample.
  *
+ * With speculation enabled, once every sample is assigned the idle workers get copies of the units still running,
+ * up to SPECULATIVE_COPIES of each. Every replicate has its own RNG stream, so whichever copy finishes first gives
+ * the same results and the others are cancelled.
+ *
+ * @param pool the workers pool
+ * @param howmany samples to be generated
+ * @param parameters simulation parameters, used when the master works too
+ * @param options mspar's command line options
  */
-void sendResultsToMasterProcess(char* results)
+void
+scheduleSamples(struct workersPool *pool, int howmany, struct params parameters, struct msparOptions options)
 {
-    MPI_Send(results, strlen(results)+1, MPI_CHAR, 0, RESULTS_TAG, MPI_COMM_WORLD);
-}
+    int depth, idleWorker;
 
-// **************************************  //
-// UTILS
-// **************************************  //
+    // pendingSamples: utilizado para contabilidad el número de muestras asignadas pendientes de respuesta por los workers.
+    int pendingSamples = 0;
 
-/*--------------------------------------------------------------
- *
- *  DESCRIPTION: (Append strings)  CMS
- *
- *    Given two strings, lhs and rhs, the rhs string is appended
- *    to the lhs string, which can later on can be safely accessed
- *    by the caller of this function.
+    if(pool->size == 1) options.masterWorks = 1; // nobody else to do the work
+
+    while(howmany > 0 || pendingSamples > 0)
+    {
+        // Fill every worker up to one unit first, and only then queue the prefetched ones.
+        for(depth=1; depth<=PREFETCH_DEPTH && howmany > 0; depth++)
+        {
+            while(howmany > 0 && (idleWorker = findIdleWorker(pool->activity, pool->size, pool->lastAssigned, depth)) > 0)
+            {
+                int samples = computeChunkSize(howmany, pool->size, idleWorker, pool->latency, pool->sampleSize);
+                assignWork(pool, idleWorker, samples);
+                pool->lastAssigned = idleWorker;
+                howmany -= samples;
+                pendingSamples += samples;
+            }
+        }
+
+        while(options.speculate && howmany == 0 && (idleWorker = findIdleWorker(pool->activity, pool->size, pool->lastAssigned, 1)) > 0)
+        {
+            int unit = findStraggler(pool);
+            if(unit < 0) break;
+            assignCopy(pool, idleWorker, unit);
+            pool->lastAssigned = idleWorker;
+        }
+
+        if(options.masterWorks && howmany > 0)
+        {
+            pendingSamples -= pollResultsFromWorkers(pool);
+            generateMasterSample(pool, pool->assigned++, parameters);
+            howmany--;
+        }
+        else
+        {
+            pendingSamples -= readResultsFromWorkers(pool);
+        }
+    }
+}
+
+/*
+ * Generates a sample in the master process and prints it out.
  *
- *  ARGUMENTS:
+ * @param pool the workers pool, which tells where the results go (NULL = straight to the
+ *             standard output, as when replaying a single replicate)
+ * @param replicate replicate id of the sample
+ * @param parameters simulation parameters
+ */
+void
+generateMasterSample(struct workersPool *pool, int replicate, struct params parameters)
+{
+    size_t length;
+    char *results = generateSample(replicate, parameters, &length);
+
+    if(pool != NULL)
+        deliverResults(pool, replicate, 1, results, length);
+    else
+        renderSample(results);
+    free(results);
+}
+
+/*
+ * Hands the results of some samples over to the pool's destination in replicate order. Results arriving ahead of
+ * their turn are held back until every replicate before them is delivered.
  *
- *    lhs - The left hand side string
- *    rhs - The right hand side string
+ * The results of a work unit may come in several fragments: every one of them but the last carries no samples, and
+ * is written out (or held) as it comes without moving on to the next replicate.
  *
- *  RETURNS:
- *    A pointer to the new string (rhs appended to lhs)
+ * @param pool the workers pool
+ * @param first replicate id of the first sample
+ * @param samples samples contained in the results, 0 for a fragment with more results to come
+ * @param results results to be delivered
+ * @param length length of the results
+ */
+void
+deliverResults(struct workersPool *pool, int first, int samples, const char *results, size_t length)
+{
+    struct reorderBuffer *reorder = &pool->reorder;
+
+    if(first != reorder->next)
+    {
+        holdResults(reorder, first, samples, results, length);
+        return;
+    }
+
+    writeResults(pool, results, length);
+    if(samples == 0) return;
+    reorder->next += samples;
+
+    // Fragments of the same unit are held in arrival order, so they are released in order too
+    while(reorder->count > 0 && reorder->held[0].first == reorder->next)
+        releaseResults(pool);
+    releaseTbs(reorder->next);
+
+    if(pool->output == NULL) checkpointLedger(reorder->next);
+}
+
+/*
+ * Keeps a copy of results that arrived ahead of their turn, sorted by replicate id and then by arrival. Once
+ * REORDER_MEMORY_LIMIT bytes are held in memory, further results are spilled to a temporary file.
  *
- *------------------------------------------------------------*/
-char *
-append(char *lhs, const char *rhs)
+ * @param reorder the pool's reorder buffer
+ * @param first replicate id of the first sample
+ * @param samples samples contained in the results, 0 for a fragment with more results to come
+ * @param results results to be held
+ * @param length length of the results
+ */
+void
+holdResults(struct reorderBuffer *reorder, int first, int samples, const char *results, size_t length)
 {
-	size_t len1 = strlen(lhs);
-	size_t len2 = strlen(rhs) + 1; //+1 because of the terminating null
+    struct heldResults *held;
+    int i;
 
-	lhs = realloc(lhs, len1 + len2);
+    if(reorder->count == reorder->capacity)
+    {
+        reorder->capacity = reorder->capacity == 0 ? 16 : 2 * reorder->capacity;
+        reorder->held = (struct heldResults *) realloc(reorder->held, reorder->capacity * sizeof(struct heldResults));
+    }
+    for(i=reorder->count; i>0 && reorder->held[i-1].first > first; i--)
+        reorder->held[i] = reorder->held[i-1];
+    reorder->count++;
 
-	return strncat(lhs, rhs, len2);
-} /* append */
+    held = &reorder->held[i];
+    held->first = first;
+    held->samples = samples;
+    held->length = length;
+    held->results = NULL;
 
-/* Initialization of the random generator. */
-unsigned short * parallelSeed(unsigned short *seedv){
-  unsigned short *seed48();
+    if(reorder->bytes + length > REORDER_MEMORY_LIMIT && reorder->spill == NULL)
+        reorder->spill = tmpfile();
+    if(reorder->bytes + length > REORDER_MEMORY_LIMIT && reorder->spill != NULL)
+    {
+        held->offset = reorder->spillEnd;
+        fseeko(reorder->spill, held->offset, SEEK_SET);
+        if(fwrite(results, sizeof(char), length, reorder->spill) == length)
+        {
+            reorder->spillEnd += length;
+            reorder->spillLive += length;
+            return;
+        }
+    }
 
-  return seed48(seedv);
+    // Either under the limit or the spill file is not usable: keep the results in memory
+    held->results = (char *) malloc(length);
+    memcpy(held->results, results, length);
+    reorder->bytes += length;
 }
 
 /*
- * name: doInitializeRng
- * description: En caso de especificarse las semillas para inicializar el RGN,
- *              se llama a la función commandlineseed que se encuentra en el
- *              fichero del RNG.
+ * Writes out the first held results, which are the next ones in replicate order. Releasing a fragment does not move
+ * on to the next replicate: the rest of its unit is either held after it or still to come.
  *
- * @param argc la cantidad de argumentos que se recibió por línea de comandos
- * @param argv el vector que tiene los valores de cada uno de los argumentos recibidos
+ * @param pool the workers pool
  */
 void
-doInitializeRng(int argc, char *argv[], int *seeds, struct params parameters)
-{
-  int commandlineseed(char **);
-  int arg = 0;
-
-  while(arg < argc){
-    switch(argv[arg++][1]){
-      case 's':
-        if(argv[arg-1][2] == 'e'){
-          // Tanto 'pars' como 'nseeds' son variables globales
-          parameters.commandlineseedflag = 1;
-          *seeds = commandlineseed(argv+arg);
+releaseResults(struct workersPool *pool)
+{
+    struct reorderBuffer *reorder = &pool->reorder;
+    struct heldResults held = reorder->held[0];
+
+    memmove(&reorder->held[0], &reorder->held[1], (reorder->count - 1) * sizeof(struct heldResults));
+    reorder->count--;
+
+    if(held.results != NULL)
+    {
+        writeResults(pool, held.results, held.length);
+        reorder->bytes -= held.length;
+        free(held.results);
+    }
+    else
+    {
+        char buffer[1 << 16];
+        size_t done = 0, length;
+
+        fseeko(reorder->spill, held.offset, SEEK_SET);
+        while(done < held.length)
+        {
+            length = held.length - done < sizeof(buffer) ? held.length - done : sizeof(buffer);
+            length = fread(buffer, sizeof(char), length, reorder->spill);
+            if(length == 0) break;
+            writeResults(pool, buffer, length);
+            done += length;
         }
-        break;
+        reorder->spillLive -= held.length;
+        if(reorder->spillLive == 0
+           || (reorder->spillEnd > 2 * reorder->spillLive && reorder->spillEnd > REORDER_MEMORY_LIMIT))
+            compactSpill(reorder);
     }
-  }
+    reorder->next += held.samples;
+}
+
+/*
+ * Moves the results still held in the spill file to the start of a new one, dropping the space of those already
+ * released. Spilled results are released in replicate order, not in the order they were written, so the file can not
+ * just be truncated from either end. It is compacted once its released space is larger than both its live space and
+ * the memory limit, which keeps it within twice the size of what it holds at the cost of copying each byte about once.
+ *
+ * @param reorder the pool's reorder buffer
+ */
+void
+compactSpill(struct reorderBuffer *reorder)
+{
+    char buffer[1 << 16];
+    FILE *compacted;
+    off_t end = 0;
+    size_t done, length;
+    int i;
+
+    // Nothing left on disk: the file is emptied and reused from the start
+    if(reorder->spillLive == 0)
+    {
+        if(ftruncate(fileno(reorder->spill), 0) == 0) reorder->spillEnd = 0;
+        return;
+    }
+
+    if((compacted = tmpfile()) == NULL) return;
+    for(i=0; i<reorder->count; i++)
+    {
+        if(reorder->held[i].results != NULL) continue;
+        fseeko(reorder->spill, reorder->held[i].offset, SEEK_SET);
+        for(done = 0; done < reorder->held[i].length; done += length)
+        {
+            length = reorder->held[i].length - done < sizeof(buffer) ? reorder->held[i].length - done : sizeof(buffer);
+            if(fread(buffer, sizeof(char), length, reorder->spill) != length
+               || fwrite(buffer, sizeof(char), length, compacted) != length)
+            {
+                // Keep using the old file rather than losing results
+                fclose(compacted);
+                return;
+            }
+        }
+    }
+
+    // Every copy succeeded: the results are now in the new file, in the same order as held
+    for(i=0; i<reorder->count; i++)
+    {
+        if(reorder->held[i].results != NULL) continue;
+        reorder->held[i].offset = end;
+        end += reorder->held[i].length;
+    }
+    fclose(reorder->spill);
+    reorder->spill = compacted;
+    reorder->spillEnd = end;
+}
+
+/*
+ * Writes results to the pool's destination: the standard output, rendered as ms output, or when the pool is scheduled
+ * by a sub-master, the output buffer it streams to the master as they are.
+ *
+ * @param pool the workers pool
+ * @param results results to be written
+ * @param length length of the results
+ */
+void
+writeResults(struct workersPool *pool, const char *results, size_t length)
+{
+    if(pool->output != NULL)
+        pool->output = streamResults(pool->output, results, length, upperComm);
+    else
+        renderRecords(&pool->partial, results, length);
+}
+
+/*
+ * Creates the master's bookkeeping of the workers and posts a report receive for each one of them.
+ *
+ * @param poolSize processes in the pool, the master included
+ * @param comm communicator shared with the workers, where the master is rank 0
+ *
+ * @return the workers pool
+ */
+struct workersPool *
+createWorkersPool(int poolSize, MPI_Comm comm)
+{
+    int i;
+    struct workersPool *pool = (struct workersPool *) malloc(sizeof(struct workersPool));
+
+    pool->size = poolSize;
+    pool->comm = comm;
+    pool->lastAssigned = 0;
+    pool->output = NULL;
+    pool->elapsedSum = pool->elapsedSquares = 0.0;
+    pool->timedUnits = 0;
+    pool->pending = NULL;
+    pool->pendingCount = pool->pendingCapacity = 0;
+    pool->nextUnit = 0;
+    pool->assigned = firstReplicate;
+    pool->reorder.next = firstReplicate;
+    pool->reorder.held = NULL;
+    pool->reorder.count = pool->reorder.capacity = 0;
+    pool->reorder.bytes = 0;
+    pool->reorder.spill = NULL;
+    pool->reorder.spillEnd = pool->reorder.spillLive = 0;
+    pool->partial.record = NULL;
+    pool->partial.length = pool->partial.capacity = 0;
+    pool->activity = (int *) malloc(poolSize * sizeof(int));
+    pool->latency = (double *) malloc(poolSize * sizeof(double));
+    pool->sampleSize = (double *) malloc(poolSize * sizeof(double));
+    pool->reports = (struct workReport *) malloc(poolSize * sizeof(struct workReport));
+    pool->requests = (MPI_Request *) malloc(poolSize * sizeof(MPI_Request));
+    pool->results = (char *) malloc(FRAGMENT_SIZE);
+    pool->capacity = FRAGMENT_SIZE;
+    pool->shared = workersOutputs;
+    pool->window = scheduleWindow;
+
+    for(i=0; i<poolSize; i++)
+    {
+        pool->activity[i] = 0;
+        pool->latency[i] = 0.0;
+        pool->sampleSize[i] = 0.0;
+        pool->requests[i] = MPI_REQUEST_NULL;
+    }
+    pool->activity[0] = PREFETCH_DEPTH; // Master is always busy
+
+    for(i=1; i<poolSize; i++)
+        MPI_Irecv(&pool->reports[i], sizeof(struct workReport), MPI_BYTE, i, REPORT_TAG, comm, &pool->requests[i]);
+
+    return pool;
+}
+
+void
+destroyWorkersPool(struct workersPool *pool)
+{
+    int i;
+
+    for(i=1; i<pool->size; i++)
+    {
+        if(pool->requests[i] != MPI_REQUEST_NULL)
+        {
+            MPI_Cancel(&pool->requests[i]);
+            MPI_Request_free(&pool->requests[i]);
+        }
+    }
+    free(pool->activity);
+    free(pool->latency);
+    free(pool->sampleSize);
+    free(pool->reports);
+    free(pool->requests);
+    free(pool->results);
+    free(pool->pending);
+    free(pool->reorder.held);
+    free(pool->partial.record);
+    if(pool->reorder.spill != NULL) fclose(pool->reorder.spill);
+    free(pool);
+}
+
+/*
+ * Computes how many samples are going to be assigned to a worker in its next work unit.
+ *
+ * The base size follows the factoring rule: every round hands out 1/CHUNK_FACTOR of the remaining samples split
+ * among all the workers, so units start large and shrink towards the end of the run. The base size is then scaled
+ * by how fast the worker is compared to the average of the measured workers, and bounded so that a single unit
+ * does not produce more than CHUNK_BYTES_LIMIT bytes of results.
+ *
+ * @param remaining samples not yet assigned
+ * @param poolSize number of processes (master included)
+ * @param worker worker the work unit is for
+ * @param workersLatency measured seconds per sample of every worker (0 = not measured yet)
+ * @param workersSampleSize measured bytes per sample of every worker (0 = not measured yet)
+ *
+ * @return samples to be assigned, between 1 and remaining
+ */
+int
+computeChunkSize(int remaining, int poolSize, int worker, double *workersLatency, double *workersSampleSize)
+{
+    int workers = poolSize - 1;
+    double chunk = ceil((double) remaining / (CHUNK_FACTOR * workers));
+
+    if(workersLatency[worker] > 0.0)
+    {
+        int i, measured = 0;
+        double meanLatency = 0.0;
+        for(i=1; i<poolSize; i++)
+        {
+            if(workersLatency[i] > 0.0)
+            {
+                meanLatency += workersLatency[i];
+                measured++;
+            }
+        }
+        meanLatency /= measured;
+        chunk *= meanLatency / workersLatency[worker];
+    }
+    else if(chunk > FIRST_CHUNK_LIMIT)
+    {
+        chunk = FIRST_CHUNK_LIMIT;
+    }
+
+    if(workersSampleSize[worker] > 0.0 && chunk * workersSampleSize[worker] > CHUNK_BYTES_LIMIT)
+        chunk = CHUNK_BYTES_LIMIT / workersSampleSize[worker];
+
+    if(chunk < 1) chunk = 1;
+    if(chunk > remaining) chunk = remaining;
+
+    return (int) chunk;
+}
+
+/*
+ * Hace que el Master escuche los resultados enviados por los workers.
+ *
+ * The function waits for any of the pre-posted report receives and then receives the results it announces.
+ *
+ * @param pool the workers pool
+ *
+ * @return the number of samples received
+ */
+int readResultsFromWorkers(struct workersPool *pool)
+{
+    int source;
+
+    MPI_Waitany(pool->size, pool->requests, &source, MPI_STATUS_IGNORE);
+    return receiveResults(pool, source);
+}
+
+/*
+ * Receives the results of every worker whose report already arrived, without waiting for any other.
+ *
+ * @param pool the workers pool
+ *
+ * @return the number of samples received
+ */
+int pollResultsFromWorkers(struct workersPool *pool)
+{
+    int source, arrived, received = 0;
+
+    while(1)
+    {
+        MPI_Testany(pool->size, pool->requests, &source, &arrived, MPI_STATUS_IGNORE);
+        if(!arrived || source == MPI_UNDEFINED) break;
+        received += receiveResults(pool, source);
+    }
+
+    return received;
+}
+
+/*
+ * Receives the fragment of results announced by a worker's report and delivers it.
+ *
+ * Fragments are received into a buffer of FRAGMENT_SIZE bytes reused across calls, and passed on before the next
+ * one is received, so the master never holds a whole work unit. Fragments of a worker sharing memory with the master
+ * are delivered right from the worker's output buffer instead, which the worker gets back afterwards. The report
+ * receive is posted again for the worker.
+ * Results of a work unit delivered by another copy are discarded: the copy whose results come first keeps the unit.
+ *
+ * @param pool the workers pool
+ * @param source worker whose report arrived
+ *
+ * @return the number of samples received
+ */
+int receiveResults(struct workersPool *pool, int source)
+{
+    struct workReport report = pool->reports[source];
+    const char *results = pool->results;
+    int samples;
+
+    if(report.slot >= 0)
+    {
+        results = pool->shared[source] + report.slot * (FRAGMENT_SIZE + 1);
+        MPI_Win_sync(pool->window);
+    }
+    else
+    {
+        MPI_Recv(pool->results, report.size, MPI_CHAR, source, RESULTS_TAG, pool->comm, MPI_STATUS_IGNORE);
+    }
+    MPI_Irecv(&pool->reports[source], sizeof(struct workReport), MPI_BYTE, source, REPORT_TAG, pool->comm, &pool->requests[source]);
+
+    samples = deliverReport(pool, source, report, results);
+
+    if(report.slot >= 0) MPI_Send(NULL, 0, MPI_INT, source, RELEASE_TAG, pool->comm);
+    return samples;
+}
+
+/*
+ * Accounts for the report of a worker and delivers the results that came with it.
+ *
+ * @param pool the workers pool
+ * @param source worker whose report arrived
+ * @param report the worker's report
+ * @param results the results announced by the report
+ *
+ * @return the number of samples received
+ */
+int deliverReport(struct workersPool *pool, int source, struct workReport report, const char *results)
+{
+    // A fragment of a unit the worker is still generating
+    if(report.samples == 0)
+    {
+        if(report.unit == UNTRACKED_UNIT || claimUnit(pool, report.unit, source) >= 0)
+            deliverResults(pool, report.first, 0, results, report.size);
+        return 0;
+    }
+
+    updateWorkerStatistics(source, report.samples, report.elapsed, report.bytes, pool->latency, pool->sampleSize);
+    pool->elapsedSum += report.elapsed / report.samples;
+    pool->elapsedSquares += (report.elapsed / report.samples) * (report.elapsed / report.samples);
+    pool->timedUnits++;
+    pool->activity[source]--;
+
+    if(report.unit != UNTRACKED_UNIT && !completeUnit(pool, report.unit, source)) return 0;
+
+    deliverResults(pool, report.first, report.samples, results, report.size);
+    return report.samples;
+}
+
+/*
+ * Folds the measurements of a finished work unit into the worker's moving averages.
+ *
+ * @param worker worker that finished the work unit
+ * @param samples samples contained in the work unit
+ * @param elapsed seconds the worker spent simulating the samples
+ * @param bytes bytes of results produced by the work unit
+ * @param workersLatency measured seconds per sample of every worker
+ * @param workersSampleSize measured bytes per sample of every worker
+ */
+void
+updateWorkerStatistics(int worker, int samples, double elapsed, double bytes, double *workersLatency, double *workersSampleSize)
+{
+    double latency = elapsed / samples;
+    double sampleSize = bytes / samples;
+
+    if(latency <= 0.0) latency = 1e-9; // below the timer resolution
+    if(workersLatency[worker] > 0.0)
+        latency = LATENCY_WEIGHT * latency + (1 - LATENCY_WEIGHT) * workersLatency[worker];
+    if(workersSampleSize[worker] > 0.0)
+        sampleSize = SAMPLE_SIZE_WEIGHT * sampleSize + (1 - SAMPLE_SIZE_WEIGHT) * workersSampleSize[worker];
+    workersLatency[worker] = latency;
+    workersSampleSize[worker] = sampleSize;
+}
+
+/*
+ * Función que dada una lista workers, devuelve el índice de esta lista que corresponde a
+ * un worker ocioso.
+ *
+ * @param workersActivity work units queued at each worker
+ * @param poolSize el largo de la lista de workers
+ * @lastAssignedWorker el índice del último worker al que se le asignó tareas
+ * @param depth a worker with less than depth queued units is considered idle
+ *
+ * @return en caso de encontrar un worker ocioso, se devuelve su índice de la lista de workers.
+ *         En caso contrario se devuelve -1, lo cual significa que todos los workers están ocupados.
+ */
+int findIdleWorker(int* workersActivity, int poolSize, int lastAssignedWorker, int depth) {
+  /*
+   * Nota, el valor de lastIdleWorker se utiliza para dar oportunidad de ocupación a todos los
+   * workers. De otra forma habría que siempre comenzar desde 0, lo cual puede implicar que
+   * solamente los workers con menor índice sean los que siempre estén ocupados.
+   */
+
+  int result = -1;
+  int i=lastAssignedWorker+1;
+  while(i < poolSize && workersActivity[i] >= depth){
+    i++;
+  };
+
+  if(i >= poolSize){
+    i=1; // El proceso 0 es el master, por lo que no se cuenta.
+    while(i < lastAssignedWorker && workersActivity[i] >= depth){
+      i++;
+    }
+
+    if(i <= lastAssignedWorker && workersActivity[i] < depth){
+      result = i;
+    }
+  } else {
+    result = i;
+  }
+
+  return result;
+}
+
+/*
+ * Assigns samples to the workers. This implies to send the number of samples to be generated..
+ *
+ * @param pool worker's state
+ * @param worker worker's index to whom a sample is going to be assigned
+ * @param samples samples the worker is going to generate
+ */
+void assignWork(struct workersPool *pool, int worker, int samples) {
+  struct pendingUnit *pending;
+
+  if(pool->pendingCount == pool->pendingCapacity)
+  {
+    pool->pendingCapacity = pool->pendingCapacity == 0 ? pool->size * PREFETCH_DEPTH : 2 * pool->pendingCapacity;
+    pool->pending = (struct pendingUnit *) realloc(pool->pending, pool->pendingCapacity * sizeof(struct pendingUnit));
+  }
+  pending = &pool->pending[pool->pendingCount++];
+  pending->unit.id = pool->nextUnit++;
+  pending->unit.first = pool->assigned;
+  pending->unit.samples = samples;
+  pending->copies = 0;
+  pending->owner = NO_OWNER;
+  pool->assigned += samples;
+
+  assignCopy(pool, worker, pool->pendingCount - 1);
+}
+
+/*
+ * Sends a copy of a pending work unit to a worker, followed by the tbs values of its replicates when they are read
+ * from stdin.
+ *
+ * @param pool worker's state
+ * @param worker worker's index to whom the copy is going to be assigned
+ * @param index position of the unit among the pending ones
+ */
+void assignCopy(struct workersPool *pool, int worker, int index) {
+  struct pendingUnit *pending = &pool->pending[index];
+
+  assert(pending->copies < (int) (sizeof(pending->workers) / sizeof(int)));
+  MPI_Send(&pending->unit, sizeof(struct workUnit), MPI_BYTE, worker, SAMPLES_NUMBER_TAG, pool->comm);
+  if(tbsFromInput())
+  {
+    size_t length;
+    const char *text;
+
+    requireTbs(pending->unit.first + pending->unit.samples);
+    text = tbsText(pending->unit.first, pending->unit.samples, &length);
+    MPI_Send(text, length, MPI_CHAR, worker, TBS_TAG, pool->comm);
+  }
+  pending->workers[pending->copies++] = worker;
+  pool->activity[worker]++;
+}
+
+/*
+ * Finds the oldest pending work unit that may still get another speculative copy. Units whose results are already
+ * coming from one of the copies are left alone.
+ *
+ * @param pool worker's state
+ *
+ * @return the position of the unit among the pending ones, or -1 if there is none
+ */
+int findStraggler(struct workersPool *pool) {
+  int i;
+
+  for(i=0; i<pool->pendingCount; i++)
+    if(pool->pending[i].copies < SPECULATIVE_COPIES && pool->pending[i].owner == NO_OWNER) return i;
+
+  return -1;
+}
+
+/*
+ * Gives a pending work unit to the first of its copies whose results arrive, and cancels the rest of them. The
+ * results of a unit are delivered from a single copy, as they may come in several fragments.
+ *
+ * @param pool worker's state
+ * @param unit id of the work unit the results belong to
+ * @param worker worker that sent the results
+ *
+ * @return the position of the unit among the pending ones, or -1 if another copy owns or completed it
+ */
+int claimUnit(struct workersPool *pool, int unit, int worker) {
+  int i, j;
+
+  for(i=0; i<pool->pendingCount && pool->pending[i].unit.id != unit; i++);
+  if(i == pool->pendingCount) return -1;
+
+  if(pool->pending[i].owner == NO_OWNER)
+  {
+    pool->pending[i].owner = worker;
+    for(j=0; j<pool->pending[i].copies; j++)
+      if(pool->pending[i].workers[j] != worker)
+        MPI_Send(&unit, 1, MPI_INT, pool->pending[i].workers[j], CANCEL_TAG, pool->comm);
+  }
+
+  return pool->pending[i].owner == worker ? i : -1;
+}
+
+/*
+ * Marks a work unit as completed when the copy owning it reports the last of its results.
+ *
+ * @param pool worker's state
+ * @param unit id of the reported work unit
+ * @param worker worker that reported the unit
+ *
+ * @return 1 if the unit was pending, 0 if another copy owns or already completed it
+ */
+int completeUnit(struct workersPool *pool, int unit, int worker) {
+  int i = claimUnit(pool, unit, worker);
+
+  if(i < 0) return 0;
+
+  // Units are kept in assignment order, so the oldest is the first speculated on
+  memmove(&pool->pending[i], &pool->pending[i+1], (pool->pendingCount - i - 1) * sizeof(struct pendingUnit));
+  pool->pendingCount--;
+  return 1;
+}
+
+/*
+ * Assigns a static block of samples to a worker, which delivers it in as many work units as it sees fit. Blocks are
+ * not accounted in the workers' activity, since the number of reports they produce is not known beforehand.
+ *
+ * @param pool worker's state
+ * @param worker worker's index to whom the block is going to be assigned
+ * @param first replicate id of the first sample in the block
+ * @param samples samples in the block
+ */
+void assignBlock(struct workersPool *pool, int worker, int first, int samples) {
+  struct workUnit block;
+
+  block.id = UNTRACKED_UNIT;
+  block.first = first;
+  block.samples = samples;
+  MPI_Send(&block, sizeof(struct workUnit), MPI_BYTE, worker, SAMPLES_NUMBER_TAG, pool->comm);
+}
+
+/*
+ * Tells every worker of the pool there is no more work to do, and discards the results of the speculative copies
+ * still running.
+ *
+ * @param pool worker's state
+ */
+void shutdownWorkers(struct workersPool *pool) {
+  int i, running = 0;
+
+  for(i=1; i<pool->size; i++)
+  {
+    MPI_Send(NULL, 0, MPI_INT, i, SHUTDOWN_TAG, pool->comm);
+    running += pool->activity[i] > 0;
+  }
+
+  while(running > 0)
+  {
+    MPI_Waitany(pool->size, pool->requests, &i, MPI_STATUS_IGNORE);
+    receiveResults(pool, i);
+    running -= pool->activity[i] == 0;
+  }
+}
+
+// **************************************  //
+// WORKERS
+// **************************************  //
+
+/*
+ * Worker's main loop: generates the work units assigned by the master until it is told to shut down, or with RMA
+ * scheduling, the work units it claims from the shared counter until every sample was claimed. With static
+ * scheduling, the worker computes its own block of samples and generates it without hearing from the master.
+ *
+ * Results are handed off with non-blocking sends from two alternating output buffers, so the worker simulates the
+ * next unit, or the rest of the same one, while the previous results are still being delivered.
+ *
+ * @return the number of work units processed
+ */
+int
+workerProcess(int myRank, int howmany, struct params parameters, struct msparOptions options)
+{
+    struct workerOutput outputs[2], *output = &outputs[0];
+    int i, units = 0;
+    int workers, claimed = firstReplicate;
+    struct workUnit unit, block;
+    double sampleSize = 0.0;
+    MPI_Comm comm = MPI_COMM_WORLD;
+
+    if(groupComm != MPI_COMM_NULL)
+    {
+        int groupRank;
+        MPI_Comm_rank(groupComm, &groupRank);
+        if(groupRank == 0) return submasterProcess(parameters, options);
+        comm = groupComm;
+    }
+
+    MPI_Comm_size(MPI_COMM_WORLD, &workers);
+    if(workers > howmany + 1) workers = howmany + 1;
+    if(!options.masterWorks) workers--;
+    block.samples = 0;
+    if(options.replay >= 0) return 0; // the master generates the replicate alone
+    if(options.scheduling == STATIC_SCHEDULING)
+    {
+        int index = options.masterWorks ? myRank : myRank - 1;
+        block.first = firstReplicate + staticBlockStart(howmany - firstReplicate, workers, index);
+        block.samples = staticBlockSize(howmany - firstReplicate, workers, index);
+    }
+
+    for(i=0; i<2; i++) initWorkerOutput(&outputs[i], i, &outputs[1 - i]);
+    if(options.threads > 1) workerTeam = createThreadTeam(options.threads, parameters);
+
+    while(1)
+    {
+        unit.id = UNTRACKED_UNIT;
+        if(options.scheduling == RMA_SCHEDULING)
+        {
+            unit.samples = claimWorkUnit(howmany, workers, &claimed, sampleSize);
+            unit.first = claimed - unit.samples;
+        }
+        else if(block.samples > 0)
+            takeBlockUnit(&block, sampleSize, &unit);
+        else if(options.scheduling == STATIC_SCHEDULING)
+            unit.samples = 0;
+        else if(receiveWorkRequest(comm, &unit) > 0 && unit.id == UNTRACKED_UNIT)
+        {
+            block = unit;
+            takeBlockUnit(&block, sampleSize, &unit);
+        }
+        if(unit.samples == 0) break;
+
+        waitWorkerOutput(output);
+        output = generateWorkUnit(&unit, comm, parameters, output);
+        sendResultsToMasterProcess(output, comm);
+        sampleSize = output->report.bytes / output->report.samples;
+        output = output->next;
+        units++;
+    }
+
+    if(workerTeam != NULL)
+    {
+        destroyThreadTeam(workerTeam);
+        workerTeam = NULL;
+    }
+    for(i=0; i<2; i++) freeWorkerOutput(&outputs[i]);
+    return units;
+}
+
+/*
+ * Sub-master's main loop: takes work units from the master and schedules them among the workers of its group,
+ * collecting their results into a single output that is reported back to the master as one unit.
+ *
+ * Like workers, sub-masters deliver their output with non-blocking sends from two alternating buffers.
+ *
+ * @param parameters simulation parameters
+ * @param options mspar's command line options
+ *
+ * @return the number of work units processed
+ */
+int
+submasterProcess(struct params parameters, struct msparOptions options)
+{
+    struct workerOutput outputs[2], *output = &outputs[0];
+    struct workersPool *pool;
+    int i, groupSize, samples, units = 0;
+    struct workUnit request;
+
+    MPI_Comm_size(groupComm, &groupSize);
+    pool = createWorkersPool(groupSize, groupComm);
+    for(i=0; i<2; i++) initWorkerOutput(&outputs[i], i, &outputs[1 - i]);
+
+    while((samples = receiveWorkRequest(upperComm, &request)) > 0)
+    {
+        double start = MPI_Wtime();
+
+        waitWorkerOutput(output);
+        output->length = 0;
+        output->streamed = 0;
+        output->report.unit = request.id;
+        output->report.first = request.first;
+        pool->output = output;
+        pool->assigned = pool->reorder.next = request.first;
+        scheduleSamples(pool, samples, parameters, options);
+
+        // The results streamed as fragments may have left the unit in the other buffer
+        output = pool->output;
+        output->report.samples = samples;
+        output->report.size = output->length;
+        output->report.bytes = output->streamed + output->length;
+        output->report.elapsed = MPI_Wtime() - start;
+        sendResultsToMasterProcess(output, upperComm);
+        output = output->next;
+        units++;
+    }
+
+    shutdownWorkers(pool);
+    destroyWorkersPool(pool);
+    for(i=0; i<2; i++) freeWorkerOutput(&outputs[i]);
+    return units;
+}
+
+/*
+ * Generates the samples of a work unit into the output buffer, sending every FRAGMENT_SIZE bytes of results to the
+ * master as soon as they are complete. Each fragment leaves the unit's results in the other buffer (see
+ * streamResults), so the unit may end in either of them.
+ *
+ * A unit tracked by the master stops early if the master cancels it because another copy already delivered it; the
+ * report then carries just the samples generated so far, which the master discards anyway.
+ *
+ * With a team of simulation threads, the samples are generated by the team and taken here in replicate order.
+ *
+ * @param unit the work unit to be generated
+ * @param comm communicator shared with the master, where the master is rank 0
+ * @param parameters simulation parameters
+ * @param output buffer the results are written to, ready to be written
+ *
+ * @return the buffer holding the last results of the unit, whose report is ready to be sent
+ */
+struct workerOutput *
+generateWorkUnit(struct workUnit *unit, MPI_Comm comm, struct params parameters, struct workerOutput *output)
+{
+    int i, delivered, samples = unit->samples;
+    double start = MPI_Wtime();
+    char *singleResult;
+    size_t length;
+
+    output->length = 0;
+    output->streamed = 0;
+    output->report.unit = unit->id;
+    output->report.first = unit->first;
+    if(workerTeam != NULL) startTeamUnit(workerTeam, unit);
+    for(i=0; i<samples; i++)
+    {
+        if(workerTeam != NULL)
+            singleResult = takeTeamSample(workerTeam, i, &length);
+        else
+            singleResult = generateSample(unit->first + i, parameters, &length);
+        output = streamResults(output, singleResult, length, comm);
+        free(singleResult);
+
+        // Gives MPI the chance to progress the delivery of the previous results
+        MPI_Testall(2, output->next->requests, &delivered, MPI_STATUSES_IGNORE);
+
+        if(unit->id != UNTRACKED_UNIT && unitCancelled(comm, unit->id))
+        {
+            samples = i + 1;
+            break;
+        }
+    }
+    if(workerTeam != NULL) finishTeamUnit(workerTeam);
+
+    output->report.samples = samples;
+    output->report.size = output->length;
+    output->report.bytes = output->streamed + output->length;
+    output->report.elapsed = MPI_Wtime() - start;
+    return output;
+}
+
+/*
+ * Starts the simulation threads of a worker. The worker's own thread is one of the team, so size - 1 threads are
+ * started; they wait for work units until the team is destroyed.
+ *
+ * @param size threads of the team, the worker's own included
+ * @param parameters simulation parameters
+ *
+ * @return the team
+ */
+struct threadTeam *
+createThreadTeam(int size, struct params parameters)
+{
+    int i;
+    struct threadTeam *team = malloc(sizeof(struct threadTeam));
+
+    team->size = size;
+    team->parameters = parameters;
+    team->unit.samples = 0;
+    team->next = team->streamed = team->active = 0;
+    team->window = TEAM_WINDOW_PER_THREAD * size;
+    team->records = calloc(team->window, sizeof(char *));
+    team->lengths = malloc(team->window * sizeof(size_t));
+    team->shutdown = 0;
+    pthread_mutex_init(&team->lock, NULL);
+    pthread_cond_init(&team->work, NULL);
+    pthread_cond_init(&team->done, NULL);
+
+    team->threads = malloc((size - 1) * sizeof(pthread_t));
+    for(i=0; i<size-1; i++)
+    {
+        if(pthread_create(&team->threads[i], NULL, teamThread, team) != 0)
+        {
+            fprintf(stderr, " could not start the simulation threads\n");
+            abortRun();
+        }
+    }
+    return team;
+}
+
+/*
+ * Stops the simulation threads of a worker, once no work unit is being generated, and frees the team.
+ *
+ * @param team the team
+ */
+void
+destroyThreadTeam(struct threadTeam *team)
+{
+    int i;
+
+    pthread_mutex_lock(&team->lock);
+    team->shutdown = 1;
+    pthread_cond_broadcast(&team->work);
+    pthread_mutex_unlock(&team->lock);
+    for(i=0; i<team->size-1; i++) pthread_join(team->threads[i], NULL);
+
+    pthread_mutex_destroy(&team->lock);
+    pthread_cond_destroy(&team->work);
+    pthread_cond_destroy(&team->done);
+    free(team->threads);
+    free(team->records);
+    free(team->lengths);
+    free(team);
+}
+
+/*
+ * Main loop of a simulation thread: generates the next sample of the current work unit whenever it falls within the
+ * window ahead of the samples already taken by the worker's thread, and otherwise waits for it to move on.
+ *
+ * @param arg the team
+ *
+ * @return NULL
+ */
+void *
+teamThread(void *arg)
+{
+    struct threadTeam *team = arg;
+
+    pthread_mutex_lock(&team->lock);
+    while(!team->shutdown)
+    {
+        if(team->next < team->unit.samples && team->next < team->streamed + team->window)
+            generateTeamSample(team);
+        else
+            pthread_cond_wait(&team->work, &team->lock);
+    }
+    pthread_mutex_unlock(&team->lock);
+    return NULL;
+}
+
+/*
+ * Generates the next sample of the team's work unit. Called with the team's lock held, which is released while the
+ * sample is simulated: every thread has its own simulator and RNG state.
+ *
+ * @param team the team, with a sample left to be generated within its window
+ */
+void
+generateTeamSample(struct threadTeam *team)
+{
+    int sample = team->next++;
+    int replicate = team->unit.first + sample;
+    size_t length;
+    char *record;
+
+    team->active++;
+    pthread_mutex_unlock(&team->lock);
+    record = generateSample(replicate, team->parameters, &length);
+    pthread_mutex_lock(&team->lock);
+    team->active--;
+
+    team->records[sample % team->window] = record;
+    team->lengths[sample % team->window] = length;
+    pthread_cond_broadcast(&team->done);
+}
+
+/*
+ * Hands a work unit over to the team, whose threads start generating its samples.
+ *
+ * @param team the team
+ * @param unit the work unit to be generated
+ */
+void
+startTeamUnit(struct threadTeam *team, struct workUnit *unit)
+{
+    pthread_mutex_lock(&team->lock);
+    team->unit = *unit;
+    team->next = team->streamed = 0;
+    pthread_cond_broadcast(&team->work);
+    pthread_mutex_unlock(&team->lock);
+}
+
+/*
+ * Takes a sample of the team's work unit, in order, generating samples too while it is not ready yet. Taking the
+ * sample moves the window on, so the threads can go on generating.
+ *
+ * @param team the team
+ * @param sample the sample to be taken, the one after the last sample taken
+ * @param length where the length of the sample record is stored
+ *
+ * @return the sample record, to be freed by the caller
+ */
+char *
+takeTeamSample(struct threadTeam *team, int sample, size_t *length)
+{
+    char *record;
+
+    pthread_mutex_lock(&team->lock);
+    while(team->records[sample % team->window] == NULL)
+    {
+        if(team->next < team->unit.samples && team->next < team->streamed + team->window)
+            generateTeamSample(team);
+        else
+            pthread_cond_wait(&team->done, &team->lock);
+    }
+    record = team->records[sample % team->window];
+    *length = team->lengths[sample % team->window];
+    team->records[sample % team->window] = NULL;
+    team->streamed = sample + 1;
+    pthread_cond_broadcast(&team->work);
+    pthread_mutex_unlock(&team->lock);
+    return record;
+}
+
+/*
+ * Ends the team's work unit, which may have been cancelled before all of its samples were taken: waits for the
+ * samples still being generated and drops those never taken.
+ *
+ * @param team the team
+ */
+void
+finishTeamUnit(struct threadTeam *team)
+{
+    int i;
+
+    pthread_mutex_lock(&team->lock);
+    team->unit.samples = 0;
+    while(team->active > 0) pthread_cond_wait(&team->done, &team->lock);
+    for(i=0; i<team->window; i++)
+    {
+        free(team->records[i]);
+        team->records[i] = NULL;
+    }
+    team->next = team->streamed = 0;
+    pthread_mutex_unlock(&team->lock);
+}
+
+/*
+ * Appends results to an output buffer, growing it geometrically. The buffer is kept null terminated.
+ *
+ * Work units carry many samples, so the results length is tracked here rather than recomputed by append().
+ *
+ * @param output buffer the results are appended to
+ * @param results results to be appended
+ * @param length length of the results
+ */
+void
+appendResults(struct workerOutput *output, const char *results, size_t length)
+{
+    if(output->length + length + 1 > output->capacity)
+    {
+        assert(output->slot < 0); // shared buffers cannot grow, but streamResults never fills them
+        if(output->capacity == 0) output->capacity = length + 1;
+        while(output->length + length + 1 > output->capacity) output->capacity *= 2;
+        output->results = realloc(output->results, output->capacity);
+    }
+    memcpy(output->results + output->length, results, length);
+    output->length += length;
+    output->results[output->length] = '\0';
+}
+
+/*
+ * Appends results to an output buffer, sending its contents to the master each time they reach FRAGMENT_SIZE
+ * bytes. The report of every fragment carries no samples, which tells the master more results of the unit follow.
+ *
+ * @param output buffer the results are appended to, whose report identifies the work unit
+ * @param results results to be appended
+ * @param length length of the results
+ * @param comm communicator shared with the master, where the master is rank 0
+ *
+ * @return the buffer the results of the unit go on in: the other one after a fragment was sent
+ */
+struct workerOutput *
+streamResults(struct workerOutput *output, const char *results, size_t length, MPI_Comm comm)
+{
+    size_t room;
+
+    while(output->length + length >= FRAGMENT_SIZE)
+    {
+        room = FRAGMENT_SIZE - output->length;
+        appendResults(output, results, room);
+        output = sendFragment(output, comm);
+        results += room;
+        length -= room;
+    }
+    appendResults(output, results, length);
+    return output;
+}
+
+/*
+ * Sends the contents of an output buffer to the master as a fragment of the work unit, and moves the unit on to the
+ * other buffer of the pair.
+ *
+ * The sends are non-blocking, like those of the last results, so the worker goes on generating while the fragment
+ * is delivered; it only waits when the other buffer is still being delivered too. Since the two buffers alternate,
+ * a unit never holds more than two fragments in memory.
+ *
+ * @param output buffer whose contents are sent
+ * @param comm communicator shared with the master, where the master is rank 0
+ *
+ * @return the buffer the results of the unit go on in, empty
+ */
+struct workerOutput *
+sendFragment(struct workerOutput *output, MPI_Comm comm)
+{
+    struct workerOutput *next = output->next;
+
+    waitWorkerOutput(next);
+    next->report = output->report;
+    next->streamed = output->streamed + output->length;
+    next->length = 0;
+
+    output->report.samples = 0;
+    output->report.size = output->length;
+    output->report.bytes = output->report.elapsed = 0.0;
+    sendResultsToMasterProcess(output, comm);
+    return next;
+}
+
+/*
+ * Takes the next work unit out of a static block, small enough for the master to print the results as they come
+ * and bounded so that its results do not exceed CHUNK_BYTES_LIMIT bytes.
+ *
+ * @param block samples left in the block; updated with the ones taken
+ * @param sampleSize measured bytes per sample of this process (0 = not measured yet)
+ * @param unit where the work unit is stored
+ *
+ * @return samples to be generated, or 0 if the block is exhausted
+ */
+int
+takeBlockUnit(struct workUnit *block, double sampleSize, struct workUnit *unit)
+{
+    double chunk = block->samples;
+
+    if(chunk > FIRST_CHUNK_LIMIT) chunk = FIRST_CHUNK_LIMIT;
+    if(sampleSize > 0.0 && chunk * sampleSize > CHUNK_BYTES_LIMIT) chunk = CHUNK_BYTES_LIMIT / sampleSize;
+    if(chunk < 1 && block->samples > 0) chunk = 1;
+
+    unit->id = UNTRACKED_UNIT;
+    unit->first = block->first;
+    unit->samples = (int) chunk;
+    block->first += unit->samples;
+    block->samples -= unit->samples;
+    return unit->samples;
+}
+
+/*
+ * Receives the work unit the Master process asked to be generated. Cancellations of units already delivered are
+ * skipped.
+ *
+ * @param comm communicator shared with the master, where the master is rank 0
+ * @param unit where the work unit is stored; an UNTRACKED_UNIT id means the samples are a static block
+ * @return samples to be generated, or 0 if the master asked the worker to shut down
+ */
+int receiveWorkRequest(MPI_Comm comm, struct workUnit *unit){
+  MPI_Status status;
+
+  while(1)
+  {
+    MPI_Probe(0, MPI_ANY_TAG, comm, &status);
+    if(status.MPI_TAG == SHUTDOWN_TAG)
+    {
+      MPI_Recv(NULL, 0, MPI_INT, 0, SHUTDOWN_TAG, comm, &status);
+      unit->samples = 0;
+      return 0;
+    }
+    if(status.MPI_TAG == SAMPLES_NUMBER_TAG) break;
+    unitCancelled(comm, UNTRACKED_UNIT);
+  }
+
+  MPI_Recv(unit, sizeof(struct workUnit), MPI_BYTE, 0, SAMPLES_NUMBER_TAG, comm, &status);
+  if(tbsFromInput())
+  {
+    int length;
+    char *text;
+
+    MPI_Probe(0, TBS_TAG, comm, &status);
+    MPI_Get_count(&status, MPI_CHAR, &length);
+    text = (char *) malloc(length);
+    MPI_Recv(text, length, MPI_CHAR, 0, TBS_TAG, comm, MPI_STATUS_IGNORE);
+    loadTbs(unit->first, unit->samples, text, length);
+    free(text);
+  }
+  return unit->samples;
+}
+
+/*
+ * Receives the cancellations sent by the master so far and tells whether the given unit is among them.
+ *
+ * @param comm communicator shared with the master, where the master is rank 0
+ * @param unit id of the work unit being generated
+ *
+ * @return 1 if the unit was cancelled, 0 otherwise
+ */
+int unitCancelled(MPI_Comm comm, int unit){
+  int pending, cancelled, result = 0;
+
+  while(1)
+  {
+    MPI_Iprobe(0, CANCEL_TAG, comm, &pending, MPI_STATUS_IGNORE);
+    if(!pending) break;
+    MPI_Recv(&cancelled, 1, MPI_INT, 0, CANCEL_TAG, comm, MPI_STATUS_IGNORE);
+    if(cancelled == unit) result = 1;
+  }
+
+  return result;
+}
+
+/*
+ * Sent Worker's results to the Master process.
+ *
+ * These are the last results of the work unit, or a fragment of it (at most FRAGMENT_SIZE bytes either way), preceded
+ * by a report with their size and the unit's samples, so the master can receive them into a buffer of its own.
+ * Both sends are non-blocking: the output buffer must not be touched until its requests complete.
+ *
+ * @param output the work unit's results and report
+ * @param comm communicator shared with the master, where the master is rank 0
+ *
+ */
+void sendResultsToMasterProcess(struct workerOutput *output, MPI_Comm comm)
+{
+    output->report.slot = output->slot;
+    if(output->slot >= 0)
+    {
+        MPI_Win_sync(reportWindow);
+        MPI_Isend(&output->report, sizeof(struct workReport), MPI_BYTE, 0, REPORT_TAG, comm, &output->requests[0]);
+        MPI_Irecv(NULL, 0, MPI_INT, 0, RELEASE_TAG, comm, &output->requests[1]);
+    }
+    else
+    {
+        MPI_Isend(&output->report, sizeof(struct workReport), MPI_BYTE, 0, REPORT_TAG, comm, &output->requests[0]);
+        MPI_Isend(output->results, output->report.size, MPI_CHAR, 0, RESULTS_TAG, comm, &output->requests[1]);
+    }
+}
+
+/*
+ * Sets up an output buffer of a worker (or a sub-master), in shared memory when the master runs on the same node.
+ *
+ * @param output the output buffer
+ * @param slot position of the buffer among the worker's ones
+ * @param next the other buffer of the pair, where the results go on while this one is delivered
+ */
+void initWorkerOutput(struct workerOutput *output, int slot, struct workerOutput *next)
+{
+    output->results = NULL;
+    output->capacity = 0;
+    output->slot = -1;
+    if(sharedOutputs != NULL)
+    {
+        output->results = sharedOutputs + slot * (FRAGMENT_SIZE + 1);
+        output->capacity = FRAGMENT_SIZE + 1;
+        output->slot = slot;
+    }
+    output->requests[0] = output->requests[1] = MPI_REQUEST_NULL;
+    output->next = next;
+}
+
+/*
+ * Waits until the results of an output buffer are delivered (or released by the master, when in shared memory), so
+ * the buffer can be written again.
+ *
+ * @param output the output buffer
+ */
+void waitWorkerOutput(struct workerOutput *output)
+{
+    MPI_Waitall(2, output->requests, MPI_STATUSES_IGNORE);
+    if(output->slot >= 0) MPI_Win_sync(reportWindow);
+}
+
+/*
+ * Waits for the last results of an output buffer and frees it.
+ *
+ * @param output the output buffer
+ */
+void freeWorkerOutput(struct workerOutput *output)
+{
+    waitWorkerOutput(output);
+    if(output->slot < 0) free(output->results);
 }
@@ -1,23 +1,499 @@
-int masterWorkerSetup(int argc, char *argv[], int howmany, struct params parameters);
+#ifndef MSPAR_THREADS
+#include <mpi.h> /* OpenMPI library */
+#endif
+#include <pthread.h>
+#include <stdint.h>
+
+// How work is distributed among the processes (--scheduling)
+enum schedulingPolicy {
+    DYNAMIC_SCHEDULING,         // the master assigns work units on demand
+    RMA_SCHEDULING,             // the workers claim work units from a shared counter
+    STATIC_SCHEDULING,          // every process generates a fixed block of samples
+    AUTO_SCHEDULING             // static or dynamic, chosen after measuring the variance in a pilot phase
+};
+
+// mspar's own command line options
+struct msparOptions {
+    int masterWorks;            // 1 if the master simulates samples too (--master-works)
+    enum schedulingPolicy scheduling;
+    int groupSize;              // processes per sub-master group, NODE_GROUPS for one per node, 0 = flat (--hierarchy)
+    int speculate;              // 1 if idle workers re-execute running work units at the tail of a run (--speculate)
+    int replay;                 // replicate to be generated alone, -1 for a regular run (--replay)
+    char *output;               // file the master writes the output to, NULL for the standard output (--output)
+    int checkpoint;             // replicates between checkpoints of the output's ledger, 0 = none (--checkpoint)
+    int resume;                 // 1 to resume an interrupted run from its ledger (--resume)
+    int sharedMemory;           // 1 if workers on the master's node hand results over through shared memory
+    int threads;                // simulation threads of every worker, or of mspar-threads, 0 if not given (--threads)
+    int segmentThreads;         // threads mutating the segments of every replicate (--segment-threads)
+    char *sweep;                // manifest of the parameter sets of a sweep, NULL for a single set (--sweep)
+    double *priors;             // low and high bounds of the uniform prior of each tbs argument, NULL = stdin (--prior)
+    int npriors;                // number of priors
+    char *abc;                  // statistics compared by ABC rejection, NULL without it (--abc)
+    char *observed;             // observed values of the statistics (--observed)
+    double tolerance;           // highest distance to the observed values accepted (--tolerance)
+    char *cache;                // directory of the result cache, NULL without it (--cache)
+    long long cacheSize;        // bytes the result cache may take up (--cache-size, given in MB)
+    int binary;                 // 1 to write the sample records out as they are, instead of ms output (--binary)
+};
+
+// Parameter set of a sweep. The sets of a sweep are generated as a single run, one after the other, so the
+// replicate id of a sample tells the set it belongs to. Within the set, replicates are numbered from 0.
+struct sweepSet {
+    char *output;               // file the samples of the set are written to
+    char *command;              // ms arguments of the set, for the header of its output
+    struct params parameters;   // parsed arguments
+    int howmany;                // replicates of the set
+    int first;                  // replicate id of the first replicate of the set within the sweep
+    double cost;                // estimated cost of a replicate
+    int index;                  // line of the set in the manifest
+};
+
+// Parameter sets of a sweep (--sweep)
+struct sweep {
+    struct sweepSet *sets;      // the sets, most expensive replicates first
+    int count;                  // number of sets, 0 without a sweep
+    int current;                // set being written out, -1 before the first one
+    int rendered;               // replicates written out so far
+    const char *program;        // name of the program, heading the output of every set
+};
+
+// Field of the parameters a "tbs" argument stands for
+enum tbsField {
+    TBS_THETA, TBS_SEGSITES, TBS_RHO, TBS_NSITES, TBS_CONVERSION, TBS_TRACK_LENGTH, TBS_GROWTH, TBS_SIZE,
+    TBS_POPULATION_GROWTH, TBS_MIGRATION, TBS_EVENT_TIME, TBS_EVENT_PARAMETER
+};
+
+// A "tbs" argument of the command line: the field of the parameters its value goes to
+struct tbsBinding {
+    enum tbsField field;
+    int i, j;                   // population(s) of the field; for events, the position of the event in the list
+    struct devent *event;       // event of the field, while the arguments are being parsed
+};
+
+// Text built piece by piece (trees, command lines), kept and reused across samples so that building it does not
+// allocate once the buffer has grown to its size
+struct outputBuffer {
+    char *text;                 // the text, always null terminated once something was appended
+    size_t length;              // length of the text (terminating null excluded)
+    size_t capacity;            // size of the text buffer
+};
+
+// Per replicate parameters ("tbs" arguments), drawn from priors or read from stdin. The values read are kept as ms
+// prints them, for a window of replicates: the master reads them as the work units needing them are handed out, and
+// sends them along with every unit.
+struct tbsValues {
+    struct tbsBinding *bindings;    // the tbs arguments, in command line order
+    int count;                      // number of tbs arguments, 0 without them
+    double *priors;                 // low and high bounds of the uniform prior of each argument, NULL = stdin
+    FILE *input;                    // where the values are read from, NULL if they come with the work units
+    int read;                       // replicates read from the input so far
+    struct outputBuffer text;       // a tab and the value of every argument, per replicate of the window, each
+                                    // replicate null terminated
+    size_t *offsets;                // where the text of every replicate of the window starts
+    int capacity;                   // size of offsets
+    int first;                      // replicate id of the first replicate of the window
+    int loaded;                     // replicates in the window
+    int released;                   // replicates at the start of the window no longer needed (see releaseTbs)
+};
+
+// Summary statistic of a sample, as sample_stats computes it
+enum abcStatistic { ABC_PI, ABC_SEGSITES, ABC_TAJIMA_D, ABC_THETA_H, ABC_FAY_H };
+
+// ABC rejection (--abc): the samples are reduced to their statistics, and only the ones close enough to the observed
+// values are kept
+struct abcRejection {
+    enum abcStatistic *statistics;  // statistics compared, in output order
+    int count;                      // number of statistics, 0 without ABC rejection
+    double *observed;               // observed value of each statistic
+    double tolerance;               // highest distance accepted
+};
+
+// Result cache (--cache): blocks of consecutive sample records, stored under a hash of everything they depend on
+struct resultCache {
+    char *directory;            // NULL without a cache
+    long long limit;            // bytes the cache may take up, beyond which blocks go (see evictBlocks)
+    struct params parameters;   // simulation parameters
+    unsigned short seeds[3];    // RNG seeds of the run
+    int howmany;                // replicates of the run
+    int next;                   // replicate id of the next record rendered
+    int storing;                // 1 once the records rendered are to be stored
+    int complete;               // 1 if the block being rendered holds its records from its first one on
+    char *block;                // records of the block being rendered
+    size_t length, capacity;    // bytes of the block's records, and room for them
+    int hits, misses;           // blocks served from the cache, and blocks generated
+    int served, stored, evicted; // replicates served, blocks stored and blocks evicted
+};
+
+// Block file found in the cache directory, when evicting blocks
+struct cachedBlock {
+    char *path;
+    unsigned long long run;     // hash of the run the block belongs to, 0 for blocks of older formats
+    int index;                  // index of the block within its run
+    double used;                // last time the block, and then any block of its run, was stored or served
+    long long size;             // bytes of the file
+};
+
+// Value the tbs arguments take while the command line is parsed, chosen to pass getpars' checks
+#define TBS_PLACEHOLDER 2.0
+
+// On-disk record of how far the output of a run got, kept next to the output file
+struct ledger {
+    char *path;                 // ledger file (NULL = no ledger)
+    char *temporary;            // the ledger is written here first, then renamed
+    int interval;               // replicates between checkpoints
+    int written;                // replicates recorded by the last checkpoint
+    int howmany;                // replicates of the whole run
+    unsigned short seeds[3];    // seeds the replicates' streams are keyed by
+    off_t header;               // bytes of output ahead of the first replicate
+};
+
+// Binary output (--binary) starts with this line, which tells the version of its format, and BINARY_BYTE_ORDER as a
+// 32 bit little-endian integer. The header ms output would have (the command line and the seeds) follows, ended by a
+// null, and then the sample records in replicate order (see writeBinaryRecord). mspar-convert prints it as ms output.
+#define BINARY_MAGIC "mspar binary 2\n"
+#define BINARY_BYTE_ORDER 0x01020304
+
+#define LEDGER_FORMAT "mspar ledger\nhowmany %d\nseeds %hu %hu %hu\nheader %lld\nreplicates %d\noffset %lld\n"
+
+#define NODE_GROUPS -1
+
+// Work unit sent by the master to a worker
+struct workUnit {
+    int id;                     // identifies the copies of the same unit, UNTRACKED_UNIT for a static block
+    int first;                  // replicate id of the first sample
+    int samples;                // samples to be generated
+};
+
+// Id of the work units the master does not keep track of (static blocks and units claimed through RMA)
+#define UNTRACKED_UNIT -1
+
+// Binary record of a sample, as the workers send it. The header is followed by tbsLength bytes of the text of the
+// tbs values, treesLength bytes of trees text, segsites positions (doubles) and segsites haplotype columns of
+// (nsam + 7) / 8 bytes each, where bit i of column j is the allele of haplotype i at site j. The master renders it as
+// ms output.
+struct sampleRecord {
+    size_t length;              // bytes of the record, header included
+    int flags;                  // RECORD_* lines to be rendered
+    int segsites;               // segregating sites
+    int nsam;                   // haplotypes
+    int precision;              // decimals of the positions
+    int tbsLength;              // bytes of the text of the tbs values, as printed after the //
+    int treesLength;            // bytes of trees text
+    double probss;              // probability of the segregating sites
+};
+
+#define RECORD_SEGSITES 1       // the segsites line is rendered (there are segregating sites or theta was given)
+#define RECORD_PROB 2           // the prob line is rendered (-s together with theta)
+#define RECORD_TREES 4          // trees are rendered ahead of the segsites line (-T)
+#define RECORD_ABC 8            // ABC row: the header is followed by the tbs values and statistics of an accepted
+                                // replicate, or by nothing for a rejected one
+
+// Master's buffer for a record split across fragments, until the rest of it arrives
+struct recordBuffer {
+    char *record;               // the part of the record received so far
+    size_t length;              // bytes received so far
+    size_t capacity;            // size of the record buffer
+};
+
+// Room formatFixed needs for a number
+#define FIXED_LENGTH 64
+
+#ifndef MSPAR_THREADS
+
+// Master's record of a work unit assigned but not delivered yet
+struct pendingUnit {
+    struct workUnit unit;
+    int copies;                 // copies of the unit assigned so far
+    int workers[2];             // workers the copies were assigned to (up to SPECULATIVE_COPIES)
+    int owner;                  // worker whose copy is delivered, NO_OWNER until a copy sends its first results
+};
+
+#define NO_OWNER -1
+
+// Report sent by a worker ahead of each fragment of the results of a work unit
+struct workReport {
+    int unit;           // id of the work unit
+    int first;          // replicate id of the first sample
+    int samples;        // samples contained in the work unit, 0 for a fragment sent while still generating it
+    int size;           // bytes of results in the fragment (at most FRAGMENT_SIZE)
+    double bytes;       // bytes of results of the whole work unit
+    double elapsed;     // seconds spent generating the samples
+    int slot;           // output buffer of the worker holding the results in shared memory, -1 if they follow
+};
+
+// Worker's output buffer, delivered to the master with non-blocking sends
+struct workerOutput {
+    char *results;              // results of the work unit
+    size_t length;              // length of the results (terminating null excluded)
+    size_t capacity;            // size of the results buffer
+    double streamed;            // bytes of results already sent as fragments
+    int slot;                   // position of the buffer in the worker's shared memory, -1 if it is private
+    struct workReport report;   // report sent ahead of the results
+    MPI_Request requests[2];    // report send, and results send or release receive (shared memory)
+    struct workerOutput *next;  // the other buffer of the pair, where the results go on while this one is delivered
+};
+
+// Results held by the master until the replicates before them are delivered
+struct heldResults {
+    int first;                  // replicate id of the first sample
+    int samples;                // samples contained in the results, 0 for a fragment with more results to come
+    char *results;              // the results, NULL when spilled to disk
+    size_t length;              // length of the results
+    off_t offset;               // position of the results in the spill file
+};
+
+// Master's buffer putting the results back in replicate order
+struct reorderBuffer {
+    int next;                   // replicate id to be delivered next
+    struct heldResults *held;   // results held back, sorted by replicate id
+    int count;                  // number of held results
+    int capacity;               // size of the held results array
+    size_t bytes;               // bytes of results held in memory
+    FILE *spill;                // temporary file for the results beyond REORDER_MEMORY_LIMIT (NULL until needed)
+    off_t spillEnd;             // end of the last results written to the spill file
+    off_t spillLive;            // bytes of the spill file holding results not yet released
+};
+
+// Master's bookkeeping of the workers
+struct workersPool {
+    int size;                   // number of processes (master included)
+    MPI_Comm comm;              // communicator shared with the workers, where the master is rank 0
+    int lastAssigned;           // last worker a work unit was assigned to
+    struct workerOutput *output;// where the results go when scheduling for a sub-master (NULL = standard output)
+    int *activity;              // work units queued at each worker
+    double *latency;            // measured seconds per sample of each worker (0 = not measured yet)
+    double *sampleSize;         // measured bytes per sample of each worker (0 = not measured yet)
+    struct workReport *reports; // receive slots of the pre-posted reports
+    MPI_Request *requests;      // pre-posted report receives
+    char *results;              // buffer reused to receive the results
+    int capacity;               // size of the results buffer
+    char **shared;              // output buffers of the workers sharing memory with the master (NULL = none)
+    MPI_Win window;             // window of those output buffers
+    double elapsedSum;          // seconds per sample of the received work units, summed
+    double elapsedSquares;      // seconds per sample of the received work units, squared and summed
+    int timedUnits;             // work units received
+    struct pendingUnit *pending;// work units not delivered yet, in assignment order
+    int pendingCount;           // number of pending work units
+    int pendingCapacity;        // size of the pending work units array
+    int nextUnit;               // id of the next work unit
+    int assigned;               // replicates assigned so far, which is the replicate id of the next one
+    struct reorderBuffer reorder;
+    struct recordBuffer partial;// record split across fragments, when rendering to the standard output
+};
+
+// Simulation threads of a worker, generating the samples of its work units in parallel (--threads). The worker's
+// own thread takes part too, and is the only one making MPI calls: it streams the samples in replicate order.
+struct threadTeam {
+    int size;                   // threads, the worker's own included
+    pthread_t *threads;         // the other threads
+    pthread_mutex_t lock;       // guards everything below
+    pthread_cond_t work;        // signalled when there are samples to be generated, or on shutdown
+    pthread_cond_t done;        // signalled when a sample is generated
+    struct params parameters;   // simulation parameters
+    struct workUnit unit;       // work unit being generated (no samples = none)
+    int next;                   // next sample of the unit to be generated
+    int streamed;               // samples of the unit taken by the worker's thread so far
+    int active;                 // samples being generated right now
+    int window;                 // samples that may be generated ahead of the worker's thread
+    char **records;             // records of the samples in the window, by sample % window (NULL = not generated)
+    size_t *lengths;            // lengths of the records
+    int shutdown;               // 1 when the threads have to finish
+};
+
+#else
+
+// Replicates queued at a thread of the pool of mspar-threads: next, next + size, next + 2 * size... below howmany.
+// The thread takes them in order, and the other threads steal from it the oldest one when they run out of their own.
+struct replicateQueue {
+    struct threadPool *pool;    // pool of the thread
+    pthread_mutex_t lock;       // guards next
+    int next;                   // next replicate in the queue
+};
+
+// Work-stealing pool of mspar-threads, which generates the replicates in a single process without MPI
+struct threadPool {
+    int size;                   // threads, the main one included
+    pthread_t *threads;         // the other threads
+    struct params parameters;   // simulation parameters
+    int howmany;                // replicates of the run
+    struct replicateQueue *queues;  // queue of every thread
+    pthread_mutex_t lock;       // guards the output, everything below
+    pthread_cond_t written;     // signalled when the output moves on
+    int next;                   // next replicate to be written
+    int window;                 // replicates that may be generated ahead of the next one to be written
+    char **records;             // records waiting for their turn, by replicate % window (NULL = not generated)
+};
+
+// Header of a job handed over to mspar-threads running as a service (--serve), see msparservice.c
+struct serviceJob {
+    int argc;                   // arguments of the job
+    size_t length;              // bytes of the working directory and arguments that follow the header
+};
+
+#endif
+
+int masterWorkerSetup(int argc, char *argv[], int howmany, struct params parameters, struct msparOptions options);
 void masterWorkerTeardown();
-void masterProcessingLogic(int howmany, int lastIdleWorker, int poolSize);
-int workerProcess(int myRank, struct params parameters, int maxsites);
+int workerProcess(int myRank, int howmany, struct params parameters, struct msparOptions options);
+void abortRun();
+
+#ifndef MSPAR_THREADS
+void createSampleCounter(int myRank);
+int claimWorkUnit(int howmany, int workers, int *claimed, double sampleSize);
+int claimSamples(int howmany, int samples, int *first);
+void masterOutputLogic(int howmany, int poolSize, struct params parameters, struct msparOptions options);
+void masterStaticLogic(int howmany, int poolSize, struct params parameters, struct msparOptions options);
+void masterAutoLogic(int howmany, int poolSize, struct params parameters, struct msparOptions options);
+double staticImbalance(struct workersPool *pool, int howmany, int masterWorks, double *error);
+void collectBlocks(struct workersPool *pool, int howmany, int masterFirst, int masterBlock, struct params parameters);
+int staticBlockSize(int howmany, int participants, int index);
+int staticBlockStart(int howmany, int participants, int index);
+void masterProcessingLogic(int howmany, int lastIdleWorker, int poolSize, MPI_Comm comm, struct params parameters, struct msparOptions options);
+void scheduleSamples(struct workersPool *pool, int howmany, struct params parameters, struct msparOptions options);
+void generateMasterSample(struct workersPool *pool, int replicate, struct params parameters);
+void deliverResults(struct workersPool *pool, int first, int samples, const char *results, size_t length);
+void holdResults(struct reorderBuffer *reorder, int first, int samples, const char *results, size_t length);
+void releaseResults(struct workersPool *pool);
+void compactSpill(struct reorderBuffer *reorder);
+void writeResults(struct workersPool *pool, const char *results, size_t length);
+void createHierarchy(int myRank, int howmany, int groupSize);
+void createSharedOutputs(MPI_Comm comm);
+int submasterProcess(struct params parameters, struct msparOptions options);
 char* workerProcessingLogic(int myRank, int samples, struct params parameters, unsigned maxsites);
-void doInitializeRng(int argc, char *argv[], int *seeds, struct params parameters);
-void sendResultsToMasterProcess(char* results);
-int receiveWorkRequest();
+void sendResultsToMasterProcess(struct workerOutput *output, MPI_Comm comm);
+void appendResults(struct workerOutput *output, const char *results, size_t length);
+struct workerOutput *streamResults(struct workerOutput *output, const char *results, size_t length, MPI_Comm comm);
+struct workerOutput *sendFragment(struct workerOutput *output, MPI_Comm comm);
+void initWorkerOutput(struct workerOutput *output, int slot, struct workerOutput *next);
+void waitWorkerOutput(struct workerOutput *output);
+void freeWorkerOutput(struct workerOutput *output);
+struct workerOutput *generateWorkUnit(struct workUnit *unit, MPI_Comm comm, struct params parameters, struct workerOutput *output);
+int receiveWorkRequest(MPI_Comm comm, struct workUnit *unit);
+int unitCancelled(MPI_Comm comm, int unit);
+int takeBlockUnit(struct workUnit *block, double sampleSize, struct workUnit *unit);
 void doInitGlobalDataStructures(int argc, char *argv[], int *howmany);
-void assignWork(int* workersActivity, int assignee, int samples);
-void readResultsFromWorkers(int goToWork, int* workersActivity);
-int findIdleWorker(int* workersActivity, int poolSize, int lastAssignedWorker);
-char* generateSample(struct params parameters, unsigned maxsites);
-int isThereMoreWork();
-unsigned short* parallelSeed(unsigned short *seedv);
-char *append(char *lhs, const char *rhs);
+void assignWork(struct workersPool *pool, int assignee, int samples);
+void assignBlock(struct workersPool *pool, int worker, int first, int samples);
+void assignCopy(struct workersPool *pool, int worker, int index);
+int findStraggler(struct workersPool *pool);
+int claimUnit(struct workersPool *pool, int unit, int worker);
+int completeUnit(struct workersPool *pool, int unit, int worker);
+void shutdownWorkers(struct workersPool *pool);
+int readResultsFromWorkers(struct workersPool *pool);
+int pollResultsFromWorkers(struct workersPool *pool);
+int receiveResults(struct workersPool *pool, int source);
+int deliverReport(struct workersPool *pool, int source, struct workReport report, const char *results);
+struct threadTeam *createThreadTeam(int size, struct params parameters);
+void destroyThreadTeam(struct threadTeam *team);
+void *teamThread(void *arg);
+void generateTeamSample(struct threadTeam *team);
+void startTeamUnit(struct threadTeam *team, struct workUnit *unit);
+char *takeTeamSample(struct threadTeam *team, int sample, size_t *length);
+void finishTeamUnit(struct threadTeam *team);
+struct workersPool *createWorkersPool(int poolSize, MPI_Comm comm);
+void destroyWorkersPool(struct workersPool *pool);
+int computeChunkSize(int remaining, int poolSize, int worker, double *workersLatency, double *workersSampleSize);
+void updateWorkerStatistics(int worker, int samples, double elapsed, double bytes, double *workersLatency, double *workersSampleSize);
+int findIdleWorker(int* workersActivity, int poolSize, int lastAssignedWorker, int depth);
+#else
+struct threadPool *createThreadPool(int size, int first, int howmany, struct params parameters);
+void destroyThreadPool(struct threadPool *pool);
+void *poolThread(void *arg);
+int takeReplicate(struct threadPool *pool, int self);
+int popReplicate(struct replicateQueue *queue, int limit);
+void writeRecord(struct threadPool *pool, int replicate, char *record);
+
+/* From msparservice.c */
+void serviceSetup(int *argc, char ***argv);
+void serveJobs(const char *path, int *argc, char ***argv);
+void serviceWorker(int service, int *argc, char ***argv);
+int runJob(int service, int connection, int *argc, char ***argv);
+int receiveJob(int connection, struct serviceJob *job, int *descriptors);
+int ownPeer(int connection);
+int submitJob(const char *path, int argc, char *argv[]);
+int sendAll(int socket, const void *buffer, size_t length);
+int receiveAll(int socket, void *buffer, size_t length);
+#endif
+
+/* From msparcommon.c */
+void openOutput(struct msparOptions options);
+void beginHeader(struct msparOptions options);
+void markBinary();
+void endHeader();
+int openLedger(struct msparOptions options, int howmany, unsigned short *seeds);
+int sameHeader(const char *output);
+void checkpointLedger(int replicates);
+void writeLedger(int replicates);
+void closeLedger();
+void renderRecords(struct recordBuffer *partial, const char *results, size_t length);
+void renderSample(const char *record);
+char* generateSample(int replicate, struct params parameters, size_t *length);
+char *encodeSample(int segsites, double probss, struct gensam_result gensamResults, char **gametes, struct params parameters, const char *tbsText, size_t *length);
+int parseMsparOptions(int argc, char *argv[], struct msparOptions *options);
+void parallelSeed(unsigned short *seedv);
+void doInitializeRng(int argc, char *argv[], int *seeds, struct params parameters);
+struct params loadSweep(const char *manifest, const char *program, int *howmany);
+int compareSweepSets(const void *a, const void *b);
+double replicateCost(struct params parameters);
+struct sweepSet *findSweepSet(int replicate);
+void nextSweepSample();
+double tbsArgument(char *argv[], int arg, enum tbsField field, int i, int j, struct devent *event);
+void bindTbsArguments(int argc, char *argv[], struct params parameters);
+int tbsCount();
+int tbsFromInput();
+void openTbs(FILE *input);
+int readTbs(int replicates);
+void requireTbs(int replicates);
+const char *tbsText(int first, int count, size_t *length);
+char *tbsValues(int replicate, double *values);
+void loadTbs(int first, int count, const char *text, size_t length);
+void releaseTbs(int replicate);
+struct params tbsParameters(const double *values, struct params parameters);
+void initializeAbc(struct msparOptions options);
+void drawPriors(int replicate, double *values);
+char *rejectSample(double *row, char **gametes, int segsites, struct params parameters, size_t *length);
+int openCache(struct msparOptions options, int howmany, int first, struct params parameters, unsigned short *seeds);
+void closeCache();
+char *cacheKey(int first, int count, size_t *length, size_t *runLength);
+char *cachePath(const char *key, size_t runLength, int block);
+int loadBlock(int block, int first);
+void cacheRecord(const char *record);
+void storeBlock(int block);
+void evictBlocks();
+int compareCachedRuns(const void *a, const void *b);
+int compareCachedBlocks(const void *a, const void *b);
+void keyAppend(char **key, size_t *length, const void *bytes, size_t count);
+void keyParameters(char **key, size_t *length, struct params parameters);
+
+/* From msparformat.c */
+void printSample(const char *record);
+void writeBinaryRecord(const char *record, FILE *output);
+int readBinaryRecord(FILE *input, struct outputBuffer *record);
+void bufferLittleEndian(struct outputBuffer *buffer, uint64_t value, int count);
+uint64_t littleEndian(const unsigned char *bytes, int count);
+void bufferReserve(struct outputBuffer *buffer, size_t length);
+void bufferAppend(struct outputBuffer *buffer, const char *text, size_t length);
+void bufferPrintf(struct outputBuffer *buffer, const char *format, ...);
+void bufferFixed(struct outputBuffer *buffer, double value, int width, int precision);
+int formatFixed(char *text, double value, int width, int precision);
 
 /* From ms.c*/
+extern __thread unsigned maxsites;
+extern int segmentThreads;
+struct params getpars(int argc, char *argv[], int *phowmany, int ntbs, int count);
 char ** cmatrix(int nsam, int len);
 double ran1();
+void argcheck(int arg, int argc, char *argv[]);
+void usage();
+
+/* From tajd.c */
+double tajd(int nsam, int segsites, double sumk);
+
+/* From rand3.c */
+void replicateStream(int replicate);
+void replicateSubstream(int replicate, int substream);
+void setStreamsKey(const unsigned short *seedv);
+void getStreamsKey(unsigned short *seedv);
 
 /*
 void ordran(int n, double pbuf[]);
@@ -0,0 +1,1783 @@
+#define _GNU_SOURCE
+
+// Replicates between two checkpoints of the ledger, unless --checkpoint says otherwise
+const int CHECKPOINT_INTERVAL = 1000;
+
+// Replicates per block of the result cache (--cache), and default size of the cache
+const int CACHE_BLOCK = 1000;
+const long long CACHE_SIZE = 1024LL << 20;
+
+// Identifies the layout of the keys of the result cache, which changes along with the format of the records
+const char *CACHE_FORMAT = "mspar result cache 3";
+
+// Substream of a replicate the values of its priors are drawn from, beyond the ones of its segments (--prior)
+const int PRIOR_SUBSTREAM = -1;
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include "ms.h"
+#include "mspar.h"
+
+/* Shared by mspar and mspar-threads: sample records, the output and its ledger, and the command line options. */
+
+// Checkpoint ledger of the output (--output); its path remains NULL without it
+static struct ledger ledger = { NULL };
+
+// Parameter sets of a sweep (--sweep); it has no sets without it
+static struct sweep sweep = { NULL, 0, -1, 0, NULL };
+
+// Per replicate parameters ("tbs" arguments); it has no bindings without them
+static struct tbsValues tbs = { NULL };
+
+// Guard the window of tbs values and their input, which mspar-threads reads and releases as it goes while its threads
+// take values: a thread waiting for the input holds only the input lock, so the others go on with the values read
+static pthread_mutex_t tbsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t tbsInputLock = PTHREAD_MUTEX_INITIALIZER;
+
+// ABC rejection (--abc); it has no statistics without it
+static struct abcRejection abc = { NULL, 0, NULL, 0.0 };
+
+// Result cache (--cache); its directory remains NULL without it
+static struct resultCache cache = { NULL };
+
+// 1 if the sample records are written out as they are (--binary), 0 if they are printed as ms output
+static int binary = 0;
+
+// **************************************  //
+// OUTPUT
+// **************************************  //
+
+/*
+ * Sends the master's output to the file given with --output, instead of the standard output. A resumed run writes
+ * aside until openLedger checks it against the interrupted one, so a mistaken --resume leaves the output untouched.
+ *
+ * @param options mspar's command line options
+ */
+void
+openOutput(struct msparOptions options)
+{
+    ledger.path = (char *) malloc(strlen(options.output) + strlen(".ledger") + 1);
+    ledger.temporary = (char *) malloc(strlen(options.output) + strlen(".ledger.tmp") + 1);
+    sprintf(ledger.path, "%s.ledger", options.output);
+    sprintf(ledger.temporary, "%s.ledger.tmp", options.output);
+
+    if(freopen(options.resume ? ledger.temporary : options.output, "w+", stdout) == NULL)
+    {
+        fprintf(stderr, " can't open the output file %s\n", options.output);
+        abortRun();
+    }
+}
+
+/*
+ * Starts the header of the output, the command line and the seeds that go ahead of the samples. With --binary, the
+ * output is marked as binary first (BINARY_MAGIC and BINARY_BYTE_ORDER). A sweep writes nothing to the standard output: every set has an
+ * output and a header of its own (see nextSweepSample), so the header of the run is discarded.
+ *
+ * @param options mspar's command line options
+ */
+void
+beginHeader(struct msparOptions options)
+{
+    binary = options.binary;
+    if(options.sweep != NULL && freopen("/dev/null", "w", stdout) == NULL) abortRun();
+    markBinary();
+}
+
+/* Marks binary output as such, ahead of its header: the version of its format and its byte order. */
+void
+markBinary()
+{
+    struct outputBuffer order = { NULL, 0, 0 };
+
+    if(!binary) return;
+    fputs(BINARY_MAGIC, stdout);
+    bufferLittleEndian(&order, BINARY_BYTE_ORDER, 4);
+    fwrite(order.text, sizeof(char), order.length, stdout);
+    free(order.text);
+}
+
+/* Ends the header of the output. Binary output ends it with a null, so the records can be told apart from it. */
+void
+endHeader()
+{
+    if(binary) putchar('\0');
+}
+
+/*
+ * Sets up the checkpoint ledger, stored next to the output file. The ledger records how many replicates of the run
+ * reached the output and the output length at that point; since replicates are output in order and every one of
+ * them is generated from its own RNG stream, that is all it takes to resume the run.
+ *
+ * When resuming, the output is truncated to the last checkpoint, discarding any replicate written after it.
+ *
+ * @param options mspar's command line options
+ * @param howmany replicates of the run
+ * @param seeds RNG seeds of the run
+ *
+ * @return the first replicate still to be generated
+ */
+int
+openLedger(struct msparOptions options, int howmany, unsigned short *seeds)
+{
+    FILE *file;
+    int replicates = 0;
+    long long header, offset;
+    unsigned short recorded[3];
+
+    ledger.interval = options.checkpoint;
+    ledger.howmany = howmany;
+    memcpy(ledger.seeds, seeds, sizeof(ledger.seeds));
+    fflush(stdout);
+    ledger.header = ftello(stdout);
+    ledger.written = 0;
+
+    // Nothing to resume: the output written aside becomes the output
+    if(options.resume && access(options.output, F_OK) != 0) rename(ledger.temporary, options.output);
+    else if(options.resume)
+    {
+        if(!sameHeader(options.output))
+        {
+            fprintf(stderr, " %s does not belong to this run\n", options.output);
+            remove(ledger.temporary);
+            abortRun();
+        }
+
+        offset = ledger.header;
+        if((file = fopen(ledger.path, "r")) != NULL)
+        {
+            if(fscanf(file, LEDGER_FORMAT, &ledger.howmany, &recorded[0], &recorded[1], &recorded[2], &header,
+                      &replicates, &offset) != 7
+               || ledger.howmany != howmany || memcmp(recorded, seeds, sizeof(recorded)) != 0
+               || header != ledger.header)
+            {
+                fprintf(stderr, " %s does not belong to this run\n", ledger.path);
+                remove(ledger.temporary);
+                abortRun();
+            }
+            fclose(file);
+        }
+
+        remove(ledger.temporary);
+        if(freopen(options.output, "r+", stdout) == NULL || ftruncate(fileno(stdout), offset) != 0
+           || fseeko(stdout, offset, SEEK_SET) != 0)
+        {
+            fprintf(stderr, " can't truncate the output file %s\n", options.output);
+            abortRun();
+        }
+        ledger.written = replicates;
+        return replicates;
+    }
+
+    writeLedger(0);
+    return 0;
+}
+
+/*
+ * Checks the header written by this run (the command line and the seeds) against the one of the output to resume.
+ *
+ * @param output the output file of the interrupted run
+ *
+ * @return 1 if both headers match, 0 otherwise
+ */
+int
+sameHeader(const char *output)
+{
+    FILE *file = fopen(output, "r");
+    char *headers = (char *) malloc(2 * ledger.header + 1);
+    int same;
+
+    rewind(stdout);
+    same = file != NULL
+           && fread(headers, 1, ledger.header, stdout) == (size_t) ledger.header
+           && fread(headers + ledger.header, 1, ledger.header, file) == (size_t) ledger.header
+           && memcmp(headers, headers + ledger.header, ledger.header) == 0;
+
+    if(file != NULL) fclose(file);
+    free(headers);
+    return same;
+}
+
+/*
+ * Records a checkpoint if CHECKPOINT_INTERVAL replicates (or the ones given by --checkpoint) reached the output
+ * since the last one.
+ *
+ * @param replicates replicates output so far
+ */
+void
+checkpointLedger(int replicates)
+{
+    if(ledger.path != NULL && ledger.interval > 0 && replicates - ledger.written >= ledger.interval)
+        writeLedger(replicates);
+}
+
+/*
+ * Writes a checkpoint to the ledger. The output is synced to disk first, and the ledger is replaced atomically, so
+ * the ledger never points beyond what the output holds.
+ *
+ * @param replicates replicates output so far
+ */
+void
+writeLedger(int replicates)
+{
+    FILE *file;
+
+    fflush(stdout);
+    fsync(fileno(stdout));
+
+    file = fopen(ledger.temporary, "w");
+    if(file != NULL)
+    {
+        fprintf(file, LEDGER_FORMAT, ledger.howmany, ledger.seeds[0], ledger.seeds[1], ledger.seeds[2],
+                (long long) ledger.header, replicates, (long long) ftello(stdout));
+        fflush(file);
+        fsync(fileno(file));
+        fclose(file);
+        rename(ledger.temporary, ledger.path);
+        ledger.written = replicates;
+    }
+}
+
+/* Frees the ledger's bookkeeping at the end of the run. */
+void
+closeLedger()
+{
+    free(ledger.path);
+    free(ledger.temporary);
+    ledger.path = ledger.temporary = NULL;
+}
+
+/*
+ * Renders the sample records contained in some results. Results are fragmented regardless of the records, so a
+ * record left incomplete is kept until the results following it complete the record.
+ *
+ * @param partial buffer of the record left incomplete by the previous results
+ * @param results results to be rendered, in replicate order
+ * @param length length of the results
+ */
+void
+renderRecords(struct recordBuffer *partial, const char *results, size_t length)
+{
+    struct sampleRecord header;
+    size_t needed, taken;
+
+    while(length > 0)
+    {
+        if(partial->length == 0 && length >= sizeof(header))
+        {
+            memcpy(&header, results, sizeof(header));
+            if(header.length <= length)
+            {
+                renderSample(results);
+                results += header.length;
+                length -= header.length;
+                continue;
+            }
+        }
+
+        // Only part of the record is here: collect the header first, and then the rest of the record it tells
+        needed = sizeof(header);
+        if(partial->length >= sizeof(header))
+        {
+            memcpy(&header, partial->record, sizeof(header));
+            needed = header.length;
+        }
+        if(needed > partial->capacity)
+        {
+            partial->capacity = needed;
+            partial->record = (char *) realloc(partial->record, partial->capacity);
+        }
+        taken = needed - partial->length < length ? needed - partial->length : length;
+        memcpy(partial->record + partial->length, results, taken);
+        partial->length += taken;
+        results += taken;
+        length -= taken;
+
+        if(partial->length >= sizeof(header))
+        {
+            memcpy(&header, partial->record, sizeof(header));
+            if(partial->length == header.length)
+            {
+                renderSample(partial->record);
+                partial->length = 0;
+            }
+        }
+    }
+}
+
+/*
+ * Writes a sample record out: printed as ms does (see printSample), or as a binary record with --binary (see
+ * writeBinaryRecord).
+ *
+ * @param record the sample record
+ */
+void
+renderSample(const char *record)
+{
+    if(sweep.count > 0) nextSweepSample();
+    if(cache.storing) cacheRecord(record);
+
+    if(binary)
+        writeBinaryRecord(record, stdout);
+    else
+        printSample(record);
+}
+
+// **************************************  //
+// SAMPLES
+// **************************************  //
+
+/*
+ * Logic to generate a sample.
+ *
+ * The sample is drawn from the replicate's own RNG stream, so its contents do not depend on the process
+ * generating it nor on the scheduling.
+ *
+ * @param replicate replicate id of the sample
+ * @param parameters simulation parameters
+ * @param length where the length of the sample record is stored
+ *
+ * @return the sample record generated by the worker
+ */
+char*
+generateSample(int replicate, struct params parameters, size_t *length)
+{
+    struct gensam_result gensam(char **gametes, double *probss, double *ptmrca, double *pttot, struct params pars, int* segsites, int replicate);
+    int i;
+    int segsites, stream = replicate;
+    double probss, tmrca, ttot;
+    char *results;
+    char **gametes;
+    double *row = NULL, *values = NULL;
+    char *text = NULL;
+    struct gensam_result gensamResults;
+    struct sweepSet *set;
+
+    // ABC rows hold the tbs values of the replicate followed by its statistics
+    if(abc.count > 0) row = (double *) malloc((tbs.count + abc.count) * sizeof(double));
+    // The replicates of a set are numbered from 0, as they are in a run of the set alone
+    if(sweep.count > 0)
+    {
+        set = findSweepSet(replicate);
+        parameters = set->parameters;
+        stream = replicate - set->first;
+    }
+    if(tbs.count > 0)
+    {
+        values = row != NULL ? row : (double *) malloc(tbs.count * sizeof(double));
+        if(tbs.priors != NULL)
+            drawPriors(replicate, values);
+        else
+            text = tbsValues(replicate, values);
+        parameters = tbsParameters(values, parameters);
+    }
+    if( parameters.mp.segsitesin ==  0 )
+        gametes = cmatrix(parameters.cp.nsam,maxsites+1);
+    else
+        gametes = cmatrix(parameters.cp.nsam, parameters.mp.segsitesin+1 );
+
+    replicateStream(stream);
+    gensamResults = gensam(gametes, &probss, &tmrca, &ttot, parameters, &segsites, stream);
+    if(abc.count > 0)
+        results = rejectSample(row, gametes, segsites, parameters, length);
+    else
+        results = encodeSample(segsites, probss, gensamResults, gametes, parameters, text, length);
+    if(values != row) free(values);
+    free(row);
+    free(text);
+
+    // gametes are sized after the global maxsites, which gensam grows as needed
+    for(i=0; i<parameters.cp.nsam; i++) free(gametes[i]);
+    free(gametes);
+    free(gensamResults.positions);
+
+    return results;
+}
+
+/*
+ * Encodes a sample as a binary record, an eighth the size of the ms output of the haplotypes and with the
+ * positions at full precision, which the master renders as ms output.
+ *
+ * @param segsites segregating sites of the sample
+ * @param probss probability of the segregating sites (-s together with theta)
+ * @param gensamResults positions and trees of the sample
+ * @param gametes haplotypes of the sample, as '0' and '1' characters
+ * @param parameters simulation parameters
+ * @param tbsText text of the tbs values of the replicate (see tbsText), NULL without tbs values read from stdin
+ * @param length where the length of the record is stored
+ *
+ * @return the sample record
+ */
+char *
+encodeSample(int segsites, double probss, struct gensam_result gensamResults, char **gametes, struct params parameters, const char *tbsText, size_t *length)
+{
+    struct sampleRecord header;
+    char *record, *trees, *columns;
+    int i, j, columnSize = (parameters.cp.nsam + 7) / 8;
+
+    // Every byte of a record is set, so the same sample makes the same record (--binary, --cache)
+    memset(&header, 0, sizeof(header));
+    if(segsites > 0 || parameters.mp.theta > 0.0) header.flags |= RECORD_SEGSITES;
+    if(parameters.mp.segsitesin > 0 && parameters.mp.theta > 0.0) header.flags |= RECORD_PROB;
+    if(parameters.mp.treeflag) header.flags |= RECORD_TREES;
+    header.segsites = segsites;
+    header.nsam = parameters.cp.nsam;
+    header.precision = parameters.output_precision;
+    header.tbsLength = tbsText != NULL ? strlen(tbsText) : 0;
+    header.treesLength = parameters.mp.treeflag ? strlen(gensamResults.tree) : 0;
+    if(header.flags & RECORD_PROB) header.probss = probss;
+    header.length = sizeof(header) + header.tbsLength + header.treesLength + segsites * (sizeof(double) + columnSize);
+
+    record = (char *) malloc(header.length);
+    memcpy(record, &header, sizeof(header));
+    if(header.tbsLength > 0) memcpy(record + sizeof(header), tbsText, header.tbsLength);
+    trees = record + sizeof(header) + header.tbsLength;
+    if(header.treesLength > 0) memcpy(trees, gensamResults.tree, header.treesLength);
+    memcpy(trees + header.treesLength, gensamResults.positions, segsites * sizeof(double));
+
+    columns = trees + header.treesLength + segsites * sizeof(double);
+    memset(columns, 0, segsites * columnSize);
+    for(i=0; i<header.nsam; i++)
+        for(j=0; j<segsites; j++)
+            if(gametes[i][j] == '1') columns[j * columnSize + i / 8] |= 1 << (i % 8);
+
+    *length = header.length;
+    return record;
+}
+
+// **************************************  //
+// UTILS
+// **************************************  //
+
+/*
+ * Extracts mspar's own options (--name [value]) from the command line, leaving the ms arguments in place so
+ * getpars can parse them.
+ *
+ * @param argc number of command line arguments
+ * @param argv the command line arguments, mspar's own options removed on return
+ * @param options where the parsed options are stored
+ *
+ * @return the number of arguments left in argv
+ */
+int
+parseMsparOptions(int argc, char *argv[], struct msparOptions *options)
+{
+  int arg, kept = 1;
+
+  options->masterWorks = 0;
+  options->scheduling = DYNAMIC_SCHEDULING;
+  options->groupSize = 0;
+  options->speculate = 0;
+  options->sharedMemory = 1;
+  options->replay = -1;
+  options->output = NULL;
+  options->checkpoint = CHECKPOINT_INTERVAL;
+  options->resume = 0;
+  options->threads = 0;
+  options->segmentThreads = 1;
+  options->sweep = NULL;
+  options->priors = NULL;
+  options->npriors = 0;
+  options->abc = NULL;
+  options->observed = NULL;
+  options->tolerance = 0.0;
+  options->cache = NULL;
+  options->cacheSize = CACHE_SIZE;
+  options->binary = 0;
+
+  for(arg=1; arg<argc; arg++){
+    if(strncmp(argv[arg], "--", 2) != 0){
+      argv[kept++] = argv[arg];
+    }
+    else if(strcmp(argv[arg], "--master-works") == 0){
+      options->masterWorks = 1;
+    }
+    else if(strcmp(argv[arg], "--speculate") == 0){
+      options->speculate = 1;
+    }
+    else if(strcmp(argv[arg], "--no-shared-memory") == 0){
+      options->sharedMemory = 0;
+    }
+    else if(strcmp(argv[arg], "--output") == 0){
+      argcheck(arg+1, argc, argv);
+      options->output = argv[++arg];
+    }
+    else if(strcmp(argv[arg], "--checkpoint") == 0){
+      argcheck(arg+1, argc, argv);
+      options->checkpoint = atoi(argv[++arg]);
+    }
+    else if(strcmp(argv[arg], "--resume") == 0){
+      options->resume = 1;
+    }
+    else if(strcmp(argv[arg], "--binary") == 0){
+      options->binary = 1;
+    }
+    else if(strcmp(argv[arg], "--sweep") == 0){
+      argcheck(arg+1, argc, argv);
+      options->sweep = argv[++arg];
+    }
+    else if(strcmp(argv[arg], "--prior") == 0){
+      // bounds may well be negative (growth rates), so they are not checked with argcheck
+      if(++arg == argc) usage();
+      options->priors = (double *) realloc(options->priors, 2 * (options->npriors + 1) * sizeof(double));
+      if(sscanf(argv[arg], "%lf:%lf", &options->priors[2 * options->npriors], &options->priors[2 * options->npriors + 1]) != 2
+         || options->priors[2 * options->npriors] > options->priors[2 * options->npriors + 1]) {
+        fprintf(stderr, " --prior needs the bounds of a uniform prior, low:high\n");
+        usage();
+      }
+      options->npriors++;
+    }
+    else if(strcmp(argv[arg], "--abc") == 0){
+      argcheck(arg+1, argc, argv);
+      options->abc = argv[++arg];
+    }
+    else if(strcmp(argv[arg], "--observed") == 0){
+      if(++arg == argc) usage();
+      options->observed = argv[arg];
+    }
+    else if(strcmp(argv[arg], "--tolerance") == 0){
+      argcheck(arg+1, argc, argv);
+      options->tolerance = atof(argv[++arg]);
+    }
+    else if(strcmp(argv[arg], "--cache") == 0){
+      argcheck(arg+1, argc, argv);
+      options->cache = argv[++arg];
+    }
+    else if(strcmp(argv[arg], "--cache-size") == 0){
+      argcheck(arg+1, argc, argv);
+      options->cacheSize = atoll(argv[++arg]) << 20;
+      if(options->cacheSize <= 0) {
+        fprintf(stderr, " --cache-size needs a size in MB > 0\n");
+        usage();
+      }
+    }
+    else if(strcmp(argv[arg], "--segment-threads") == 0){
+      argcheck(arg+1, argc, argv);
+      options->segmentThreads = atoi(argv[++arg]);
+      if(options->segmentThreads < 1) {
+        fprintf(stderr, " --segment-threads needs a number of threads >= 1\n");
+        usage();
+      }
+    }
+    else if(strcmp(argv[arg], "--threads") == 0){
+      argcheck(arg+1, argc, argv);
+      options->threads = atoi(argv[++arg]);
+      if(options->threads < 1) {
+        fprintf(stderr, " --threads needs a number of threads >= 1\n");
+        usage();
+      }
+    }
+    else if(strcmp(argv[arg], "--replay") == 0){
+      argcheck(arg+1, argc, argv);
+      arg++;
+      options->replay = atoi(argv[arg]);
+      if(options->replay < 0) {
+        fprintf(stderr, " --replay needs a replicate number >= 0\n");
+        usage();
+      }
+    }
+    else if(strcmp(argv[arg], "--scheduling") == 0){
+      argcheck(arg+1, argc, argv);
+      arg++;
+      if(strcmp(argv[arg], "dynamic") == 0) options->scheduling = DYNAMIC_SCHEDULING;
+      else if(strcmp(argv[arg], "rma") == 0) options->scheduling = RMA_SCHEDULING;
+      else if(strcmp(argv[arg], "static") == 0) options->scheduling = STATIC_SCHEDULING;
+      else if(strcmp(argv[arg], "auto") == 0) options->scheduling = AUTO_SCHEDULING;
+      else {
+        fprintf(stderr, " unknown scheduling policy %s\n", argv[arg]);
+        usage();
+      }
+    }
+    else if(strcmp(argv[arg], "--hierarchy") == 0){
+      argcheck(arg+1, argc, argv);
+      arg++;
+      options->groupSize = strcmp(argv[arg], "node") == 0 ? NODE_GROUPS : atoi(argv[arg]);
+      if(options->groupSize == 0 || options->groupSize < NODE_GROUPS) {
+        fprintf(stderr, " --hierarchy must be either node or a group size > 0\n");
+        usage();
+      }
+    }
+    else {
+      fprintf(stderr, " unknown option %s\n", argv[arg]);
+      usage();
+    }
+  }
+  argv[kept] = NULL;
+
+  if(options->resume && options->output == NULL){
+    fprintf(stderr, " --resume requires --output\n");
+    usage();
+  }
+
+  if(options->resume && options->replay >= 0){
+    fprintf(stderr, " --resume and --replay can't be combined\n");
+    usage();
+  }
+
+  if(options->sweep != NULL && (options->output != NULL || options->replay >= 0)){
+    fprintf(stderr, " --sweep writes every set to its own output: it can't be combined with --output nor --replay\n");
+    usage();
+  }
+
+  if(options->abc != NULL && (options->observed == NULL || options->tolerance <= 0.0)){
+    fprintf(stderr, " --abc needs the --observed values and a --tolerance > 0\n");
+    usage();
+  }
+
+  if(options->priors != NULL && options->abc == NULL){
+    fprintf(stderr, " --prior requires --abc\n");
+    usage();
+  }
+
+  if(options->groupSize != 0 && options->scheduling != DYNAMIC_SCHEDULING){
+    fprintf(stderr, " --hierarchy requires dynamic scheduling\n");
+    usage();
+  }
+
+  // The tbs values read from stdin go along with the work units the master hands out (see tbsText), so the workers
+  // can't claim their own units nor work out their own blocks
+  for(arg = 1; arg < kept && strcmp(argv[arg], "tbs") != 0; arg++);
+  if(arg < kept && options->priors == NULL){
+    if(options->scheduling == RMA_SCHEDULING || options->scheduling == STATIC_SCHEDULING){
+      fprintf(stderr, " tbs values read from stdin require dynamic scheduling\n");
+      usage();
+    }
+    options->scheduling = DYNAMIC_SCHEDULING;
+  }
+
+  return kept;
+}
+
+/* Initialization of the random generator: sets the seeds the replicates' streams are keyed by. */
+void parallelSeed(unsigned short *seedv){
+  setStreamsKey(seedv);
+}
+
+/*
+ * name: doInitializeRng
+ * description: En caso de especificarse las semillas para inicializar el RGN,
+ *              se llama a la función commandlineseed que se encuentra en el
+ *              fichero del RNG.
+ *
+ * @param argc la cantidad de argumentos que se recibió por línea de comandos
+ * @param argv el vector que tiene los valores de cada uno de los argumentos recibidos
+ */
+void
+doInitializeRng(int argc, char *argv[], int *seeds, struct params parameters)
+{
+  int commandlineseed(char **);
+  int arg = 0;
+
+  while(arg < argc){
+    switch(argv[arg++][1]){
+      case 's':
+        if(argv[arg-1][2] == 'e'){
+          // Tanto 'pars' como 'nseeds' son variables globales
+          parameters.commandlineseedflag = 1;
+          *seeds = commandlineseed(argv+arg);
+        }
+        break;
+    }
+  }
+}
+
+// **************************************  //
+// SWEEPS
+// **************************************  //
+
+/*
+ * Loads the parameter sets of a sweep. Every line of the manifest holds a set: the file its samples are written to,
+ * followed by ms arguments (nsam howmany [options]); blank lines and lines starting with # are skipped. The seeds
+ * are common to the whole sweep and go on mspar's command line.
+ *
+ * The sets are laid out one after the other as a single run, the ones with the most expensive replicates first, so
+ * they are scheduled first and the cheap ones fill in at the end of the run.
+ *
+ * @param manifest the manifest file
+ * @param program name of the program, which heads the output of every set
+ * @param howmany where the replicates of the whole sweep are stored
+ *
+ * @return the parameters of the first set
+ */
+struct params
+loadSweep(const char *manifest, const char *program, int *howmany)
+{
+    FILE *file = fopen(manifest, "r");
+    char *line = NULL, *token, **args;
+    size_t size = 0;
+    int i, nargs, lines = 0;
+    struct sweepSet *set;
+    struct outputBuffer command;
+
+    if(file == NULL)
+    {
+        fprintf(stderr, " can't open the sweep manifest %s\n", manifest);
+        exit(1);
+    }
+
+    while(getline(&line, &size, file) != -1)
+    {
+        lines++;
+        token = line + strspn(line, " \t\r\n");
+        if(*token == '\0' || *token == '#') continue;
+
+        sweep.sets = (struct sweepSet *) realloc(sweep.sets, (sweep.count + 1) * sizeof(struct sweepSet));
+        set = &sweep.sets[sweep.count++];
+        set->index = lines;
+
+        args = (char **) malloc((strlen(token) / 2 + 2) * sizeof(char *));
+        nargs = 0;
+        for(token = strtok(token, " \t\r\n"); token != NULL; token = strtok(NULL, " \t\r\n"))
+        {
+            if(strcmp(token, "-seeds") == 0)
+            {
+                fprintf(stderr, " %s, line %d: the seeds of a sweep go on mspar's command line\n", manifest, lines);
+                exit(1);
+            }
+            if(strcmp(token, "tbs") == 0)
+            {
+                fprintf(stderr, " %s, line %d: tbs arguments can't be used in a sweep\n", manifest, lines);
+                exit(1);
+            }
+            args[nargs++] = strdup(token);
+        }
+        args[nargs] = NULL;
+
+        set->output = args[0];
+        memset(&command, 0, sizeof(command));
+        bufferAppend(&command, "", 0);
+        for(i=1; i<nargs; i++) bufferPrintf(&command, "%s ", args[i]);
+        set->command = command.text;
+        set->parameters = getpars(nargs, args, &set->howmany, 0, 0);
+        set->cost = replicateCost(set->parameters);
+    }
+    free(line);
+    fclose(file);
+
+    if(sweep.count == 0)
+    {
+        fprintf(stderr, " the sweep manifest %s has no parameter sets\n", manifest);
+        exit(1);
+    }
+
+    sweep.program = program;
+    qsort(sweep.sets, sweep.count, sizeof(struct sweepSet), compareSweepSets);
+    *howmany = 0;
+    for(i=0; i<sweep.count; i++)
+    {
+        sweep.sets[i].first = *howmany;
+        *howmany += sweep.sets[i].howmany;
+    }
+    return sweep.sets[0].parameters;
+}
+
+/* Orders the sets of a sweep by decreasing cost of their replicates, and then as they are in the manifest. */
+int
+compareSweepSets(const void *a, const void *b)
+{
+    const struct sweepSet *x = a, *y = b;
+
+    if(x->cost != y->cost) return x->cost < y->cost ? 1 : -1;
+    return x->index - y->index;
+}
+
+/*
+ * Estimates the relative cost of a replicate from the sample size and the recombination events it goes through,
+ * which grow with rho and the log of nsam; a locus can't have more breakpoints than sites, though.
+ *
+ * @param parameters simulation parameters
+ *
+ * @return the estimated cost
+ */
+double
+replicateCost(struct params parameters)
+{
+    double rho = parameters.cp.r < parameters.cp.nsites ? parameters.cp.r : parameters.cp.nsites;
+
+    return parameters.cp.nsam * (1.0 + rho * log(parameters.cp.nsam + 1.0));
+}
+
+/*
+ * Finds the set a replicate of the sweep belongs to.
+ *
+ * @param replicate replicate id within the sweep
+ *
+ * @return the set of the replicate
+ */
+struct sweepSet *
+findSweepSet(int replicate)
+{
+    int low = 0, high = sweep.count - 1, middle;
+
+    while(low < high)
+    {
+        middle = (low + high + 1) / 2;
+        if(sweep.sets[middle].first <= replicate) low = middle;
+        else high = middle - 1;
+    }
+    return &sweep.sets[low];
+}
+
+/*
+ * Moves the output on to the next replicate of the sweep, which is about to be written. The first replicate of a set
+ * switches the output to the set's file, headed as a run of the set alone with the seeds of the sweep would head it.
+ * Since the replicates of a set are numbered from 0 (see generateSample), that run writes the same samples too.
+ */
+void
+nextSweepSample()
+{
+    struct sweepSet *set;
+    unsigned short seeds[3];
+    int replicate = sweep.rendered++;
+
+    if(sweep.current + 1 == sweep.count || replicate != sweep.sets[sweep.current + 1].first) return;
+
+    set = &sweep.sets[++sweep.current];
+    if(freopen(set->output, "w", stdout) == NULL)
+    {
+        fprintf(stderr, " can't open the output file %s\n", set->output);
+        abortRun();
+    }
+    getStreamsKey(seeds);
+    markBinary();
+    fprintf(stdout, "%s %s-seeds %d %d %d \n%d %d %d\n", sweep.program, set->command, seeds[0], seeds[1], seeds[2],
+            seeds[0], seeds[1], seeds[2]);
+    endHeader();
+}
+
+// **************************************  //
+// TBS ARGUMENTS
+// **************************************  //
+
+/*
+ * Parses a numeric argument of the ms command line that may be "tbs": a value given per replicate on stdin. The
+ * command line is parsed once; each tbs argument is bound to the field it stands for, so the parameters of every
+ * replicate are made by setting those fields alone (see tbsParameters).
+ *
+ * @param argv the command line
+ * @param arg index of the argument
+ * @param field field of the parameters the argument goes to
+ * @param i population of the field, if any
+ * @param j second population of the field, if any
+ * @param event event of the field, for TBS_EVENT_TIME and TBS_EVENT_PARAMETER
+ *
+ * @return the value of the argument, or TBS_PLACEHOLDER for a tbs argument
+ */
+double
+tbsArgument(char *argv[], int arg, enum tbsField field, int i, int j, struct devent *event)
+{
+    struct tbsBinding *binding;
+
+    if(strcmp(argv[arg], "tbs") != 0) return atof(argv[arg]);
+
+    tbs.bindings = (struct tbsBinding *) realloc(tbs.bindings, (tbs.count + 1) * sizeof(struct tbsBinding));
+    binding = &tbs.bindings[tbs.count++];
+    binding->field = field;
+    binding->i = i;
+    binding->j = j;
+    binding->event = event;
+    return TBS_PLACEHOLDER;
+}
+
+/*
+ * Completes the bindings of the tbs arguments once the command line is parsed: events are bound by their position in
+ * the (time ordered) list of events, which is only known at the end. Fails if any tbs argument was left unbound,
+ * because it stands for an argument that can't take a value per replicate.
+ *
+ * @param argc number of arguments
+ * @param argv the command line
+ * @param parameters the parsed parameters
+ */
+void
+bindTbsArguments(int argc, char *argv[], struct params parameters)
+{
+    int i, position, arguments = 0;
+    struct devent *event;
+
+    for(i=1; i<argc; i++) if(strcmp(argv[i], "tbs") == 0) arguments++;
+    if(arguments != tbs.count)
+    {
+        fprintf(stderr, " tbs can only be used for theta, segsites, -r, -c, -G, -n, -g, -m, -ma and the times and\n"
+                        " values of -eN, -eG, -eM, -en, -eg, -es and -em\n");
+        exit(1);
+    }
+
+    for(i=0; i<tbs.count; i++)
+    {
+        if(tbs.bindings[i].event == NULL) continue;
+        for(position = 0, event = parameters.cp.deventlist; event != tbs.bindings[i].event; event = event->nextde)
+            position++;
+        tbs.bindings[i].i = position;
+    }
+}
+
+/* Number of tbs arguments of the command line. */
+int
+tbsCount()
+{
+    return tbs.count;
+}
+
+/* 1 if the values of the tbs arguments are read from stdin, 0 if there are none or they are drawn from priors. */
+int
+tbsFromInput()
+{
+    return tbs.count > 0 && tbs.priors == NULL;
+}
+
+/*
+ * Reads the values of the tbs arguments from the given input from now on, as the replicates needing them come (see
+ * requireTbs). Only the process reading stdin does; the others get the values along with their work units (loadTbs).
+ *
+ * @param input where the values are read from
+ */
+void
+openTbs(FILE *input)
+{
+    tbs.input = input;
+}
+
+/*
+ * Reads the values of the tbs arguments of the replicates up to the given one, one value per argument and replicate,
+ * as ms does: values are separated by white space, and kept as the text ms prints after the // of the sample. The
+ * values of the replicates released already are read past (see releaseTbs). Safe to call from several threads at
+ * once, without holding the window.
+ *
+ * @param replicates replicates to be read, counting from the first replicate of the run
+ *
+ * @return the replicates read, lower than replicates if the input ends first
+ */
+int
+readTbs(int replicates)
+{
+    static struct outputBuffer line = { NULL, 0, 0 };
+    char character;
+    int k, c, read;
+
+    if((read = __atomic_load_n(&tbs.read, __ATOMIC_ACQUIRE)) >= replicates) return read;
+
+    pthread_mutex_lock(&tbsInputLock);
+    while(tbs.read < replicates)
+    {
+        line.length = 0;
+        for(k=0; k<tbs.count; k++)
+        {
+            while((c = getc(tbs.input)) != EOF && isspace(c));
+            if(c == EOF) break;
+            bufferAppend(&line, "\t", 1);
+            do
+            {
+                character = c;
+                bufferAppend(&line, &character, 1);
+            } while((c = getc(tbs.input)) != EOF && !isspace(c));
+        }
+        if(k < tbs.count) break;
+        bufferAppend(&line, "", 1);
+
+        pthread_mutex_lock(&tbsLock);
+        if(tbs.read >= tbs.first)
+        {
+            if(tbs.loaded == tbs.capacity)
+            {
+                tbs.capacity = tbs.capacity == 0 ? 1024 : 2 * tbs.capacity;
+                tbs.offsets = (size_t *) realloc(tbs.offsets, tbs.capacity * sizeof(size_t));
+            }
+            tbs.offsets[tbs.loaded++] = tbs.text.length;
+            bufferAppend(&tbs.text, line.text, line.length);
+        }
+        __atomic_store_n(&tbs.read, tbs.read + 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&tbsLock);
+    }
+    read = tbs.read;
+    pthread_mutex_unlock(&tbsInputLock);
+    return read;
+}
+
+/*
+ * Reads the values of the tbs arguments of the replicates up to the given one, unless they are read already or come
+ * with the work units. Fails if the input ends first.
+ *
+ * @param replicates replicates needed, counting from the first replicate of the run
+ */
+void
+requireTbs(int replicates)
+{
+    int read;
+
+    if(tbs.input != NULL && (read = readTbs(replicates)) < replicates)
+    {
+        fprintf(stderr, " stdin has tbs values for %d replicates, %d are needed\n", read, replicates);
+        abortRun();
+    }
+}
+
+/*
+ * Text of the values of the tbs arguments of a run of replicates: for every replicate, a tab and the value of each
+ * argument as it was read, null terminated. Fails if the replicates are not in the window: the ones read from the
+ * input must be read first (see requireTbs).
+ *
+ * @param first replicate id of the first replicate
+ * @param count replicates of the run
+ * @param length where the length of the text is stored, the nulls included
+ *
+ * @return the text of the first replicate, followed by those of the rest
+ */
+const char *
+tbsText(int first, int count, size_t *length)
+{
+    int end = first + count;
+
+    if(first < tbs.first + tbs.released || end > tbs.first + tbs.loaded)
+    {
+        fprintf(stderr, " the tbs values of replicates %d to %d are missing\n", first, end - 1);
+        abortRun();
+    }
+
+    *length = (end < tbs.first + tbs.loaded ? tbs.offsets[end - tbs.first] : tbs.text.length)
+              - tbs.offsets[first - tbs.first];
+    return tbs.text.text + tbs.offsets[first - tbs.first];
+}
+
+/*
+ * Parses the values of the tbs arguments of a replicate, as ms does. Safe to call from several threads at once.
+ *
+ * @param replicate replicate id
+ * @param values where the values are stored
+ *
+ * @return a copy of the text of the values, as printed after the // of the sample, to be freed by the caller
+ */
+char *
+tbsValues(int replicate, double *values)
+{
+    size_t length;
+    const char *value;
+    char *text;
+    int k;
+
+    requireTbs(replicate + 1);
+    pthread_mutex_lock(&tbsLock);
+    value = tbsText(replicate, 1, &length);
+    text = strdup(value);
+    pthread_mutex_unlock(&tbsLock);
+
+    for(k=0, value = text; k<tbs.count; k++)
+    {
+        values[k] = atof(++value);
+        value += strcspn(value, "\t");
+    }
+    return text;
+}
+
+/*
+ * Replaces the window of tbs values with the ones of a work unit, as the master sent them (see tbsText).
+ *
+ * @param first replicate id of the first replicate of the unit
+ * @param count replicates of the unit
+ * @param text text of the values of the unit
+ * @param length length of the text
+ */
+void
+loadTbs(int first, int count, const char *text, size_t length)
+{
+    size_t offset;
+
+    if(count > tbs.capacity)
+    {
+        tbs.capacity = count;
+        tbs.offsets = (size_t *) realloc(tbs.offsets, tbs.capacity * sizeof(size_t));
+    }
+    tbs.text.length = 0;
+    bufferAppend(&tbs.text, text, length);
+    for(tbs.loaded = 0, offset = 0; tbs.loaded < count && offset < length; offset += strlen(text + offset) + 1)
+        tbs.offsets[tbs.loaded++] = offset;
+    tbs.first = first;
+    tbs.released = 0;
+}
+
+/*
+ * Drops the tbs values of the replicates before the given one, which are written out already. They are removed
+ * from the window once they take up half of it, so the window holds about the replicates in flight. With the cache,
+ * the values of the block being written are kept until it is stored, since they are part of its key.
+ *
+ * @param replicate first replicate whose values are still needed
+ */
+void
+releaseTbs(int replicate)
+{
+    size_t start;
+    int i;
+
+    if(cache.directory != NULL) replicate -= replicate % CACHE_BLOCK;
+    pthread_mutex_lock(&tbsLock);
+    if(replicate >= tbs.first + tbs.loaded && replicate > tbs.first + tbs.released)
+    {
+        tbs.text.length = 0;
+        tbs.first = replicate;
+        tbs.loaded = tbs.released = 0;
+    }
+    else if(replicate > tbs.first + tbs.released)
+    {
+        tbs.released = replicate - tbs.first;
+        // Compacted once the values released take up half of the window
+        if(2 * tbs.released >= tbs.loaded)
+        {
+            start = tbs.offsets[tbs.released];
+            memmove(tbs.text.text, tbs.text.text + start, tbs.text.length - start);
+            tbs.text.length -= start;
+            for(i=tbs.released; i<tbs.loaded; i++) tbs.offsets[i - tbs.released] = tbs.offsets[i] - start;
+            tbs.first = replicate;
+            tbs.loaded -= tbs.released;
+            tbs.released = 0;
+        }
+    }
+    pthread_mutex_unlock(&tbsLock);
+}
+
+/*
+ * Makes the parameters of a replicate from the parsed ones, setting the fields its tbs arguments stand for. The
+ * arrays and events a tbs argument changes are copied into buffers of the calling thread first, since the parsed
+ * parameters are shared by the threads generating samples.
+ *
+ * @param values values of the tbs arguments for the replicate
+ * @param parameters the parsed parameters
+ *
+ * @return the parameters of the replicate
+ */
+struct params
+tbsParameters(const double *values, struct params parameters)
+{
+    static __thread double *sizes = NULL, *growths = NULL, **migration = NULL;
+    static __thread struct devent *events = NULL;
+    int i, j, k, npop = parameters.cp.npop, nevents = 0;
+    int copySizes = 0, copyGrowths = 0, copyMigration = 0, copyEvents = 0, sortEvents = 0;
+    struct devent *event, moved;
+
+    for(k=0; k<tbs.count; k++)
+    {
+        switch(tbs.bindings[k].field)
+        {
+            case TBS_SIZE: copySizes = 1; break;
+            case TBS_GROWTH: case TBS_POPULATION_GROWTH: copyGrowths = 1; break;
+            case TBS_MIGRATION: copyMigration = 1; break;
+            case TBS_EVENT_TIME: sortEvents = 1; copyEvents = 1; break;
+            case TBS_EVENT_PARAMETER: copyEvents = 1; break;
+            default: break;
+        }
+    }
+    for(event = parameters.cp.deventlist; event != NULL; event = event->nextde) nevents++;
+
+    if(copySizes)
+    {
+        if(sizes == NULL) sizes = (double *) malloc(npop * sizeof(double));
+        memcpy(sizes, parameters.cp.size, npop * sizeof(double));
+        parameters.cp.size = sizes;
+    }
+    if(copyGrowths)
+    {
+        if(growths == NULL) growths = (double *) malloc(npop * sizeof(double));
+        memcpy(growths, parameters.cp.alphag, npop * sizeof(double));
+        parameters.cp.alphag = growths;
+    }
+    if(copyMigration)
+    {
+        if(migration == NULL)
+        {
+            migration = (double **) malloc(npop * sizeof(double *));
+            for(i=0; i<npop; i++) migration[i] = (double *) malloc(npop * sizeof(double));
+        }
+        for(i=0; i<npop; i++) memcpy(migration[i], parameters.cp.mig_mat[i], npop * sizeof(double));
+        parameters.cp.mig_mat = migration;
+    }
+    if(copyEvents)
+    {
+        if(events == NULL) events = (struct devent *) malloc(nevents * sizeof(struct devent));
+        for(k = 0, event = parameters.cp.deventlist; event != NULL; event = event->nextde) events[k++] = *event;
+        parameters.cp.deventlist = events;
+    }
+
+    for(k=0; k<tbs.count; k++)
+    {
+        i = tbs.bindings[k].i;
+        j = tbs.bindings[k].j;
+        switch(tbs.bindings[k].field)
+        {
+            case TBS_THETA: parameters.mp.theta = values[k]; break;
+            case TBS_SEGSITES: parameters.mp.segsitesin = (int) values[k]; break;
+            case TBS_RHO: parameters.cp.r = values[k]; break;
+            case TBS_NSITES: parameters.cp.nsites = (int) values[k]; break;
+            case TBS_CONVERSION: parameters.cp.f = values[k]; break;
+            case TBS_TRACK_LENGTH: parameters.cp.track_len = values[k]; break;
+            case TBS_GROWTH: for(j=0; j<npop; j++) growths[j] = values[k]; break;
+            case TBS_SIZE: sizes[i] = values[k]; break;
+            case TBS_POPULATION_GROWTH: growths[i] = values[k]; break;
+            case TBS_MIGRATION: migration[i][j] = values[k]; break;
+            case TBS_EVENT_TIME: events[i].time = values[k]; break;
+            case TBS_EVENT_PARAMETER: events[i].paramv = values[k]; break;
+        }
+    }
+
+    // The rate of leaving a population is the sum of its migration rates (-m, -ma)
+    if(copyMigration)
+        for(i=0; i<npop; i++)
+            for(migration[i][i] = 0.0, j=0; j<npop; j++)
+                if(j != i) migration[i][i] += migration[i][j];
+
+    // Events stay ordered by time; ties keep their order
+    if(sortEvents)
+        for(k=1; k<nevents; k++)
+        {
+            moved = events[k];
+            for(i=k; i > 0 && events[i-1].time > moved.time; i--) events[i] = events[i-1];
+            events[i] = moved;
+        }
+    if(copyEvents)
+        for(k=0; k<nevents; k++) events[k].nextde = k + 1 < nevents ? &events[k+1] : NULL;
+
+    return parameters;
+}
+
+// **************************************  //
+// ABC REJECTION
+// **************************************  //
+
+/*
+ * Sets ABC rejection up (--abc), once the command line is parsed: every replicate draws its tbs values from their
+ * priors (--prior) or reads them from stdin, and is reduced to the statistics of its sample. Only the replicates whose
+ * statistics are within the tolerance of the observed ones are written out, as rows of tbs values and statistics.
+ *
+ * @param options mspar's command line options
+ */
+void
+initializeAbc(struct msparOptions options)
+{
+    char *names, *name, *observed;
+    int i;
+
+    if(options.abc == NULL) return;
+    if(options.priors != NULL && options.npriors != tbs.count)
+    {
+        fprintf(stderr, " there are %d tbs arguments, but %d --prior\n", tbs.count, options.npriors);
+        usage();
+    }
+    tbs.priors = options.priors;
+
+    names = strdup(options.abc);
+    for(name = strtok(names, ","); name != NULL; name = strtok(NULL, ","))
+    {
+        abc.statistics = (enum abcStatistic *) realloc(abc.statistics, (abc.count + 1) * sizeof(enum abcStatistic));
+        if(strcmp(name, "pi") == 0) abc.statistics[abc.count++] = ABC_PI;
+        else if(strcmp(name, "ss") == 0 || strcmp(name, "S") == 0) abc.statistics[abc.count++] = ABC_SEGSITES;
+        else if(strcmp(name, "D") == 0) abc.statistics[abc.count++] = ABC_TAJIMA_D;
+        else if(strcmp(name, "thetaH") == 0) abc.statistics[abc.count++] = ABC_THETA_H;
+        else if(strcmp(name, "H") == 0) abc.statistics[abc.count++] = ABC_FAY_H;
+        else
+        {
+            fprintf(stderr, " unknown statistic %s: --abc takes pi, ss, D, thetaH and H\n", name);
+            usage();
+        }
+    }
+    free(names);
+
+    abc.observed = (double *) malloc(abc.count * sizeof(double));
+    observed = options.observed;
+    for(i=0; i<abc.count; i++)
+    {
+        abc.observed[i] = strtod(observed, &name);
+        if(name == observed || (*name != (i + 1 < abc.count ? ',' : '\0')))
+        {
+            fprintf(stderr, " --observed needs a value for each of the %d statistics of --abc\n", abc.count);
+            usage();
+        }
+        observed = name + 1;
+    }
+    abc.tolerance = options.tolerance;
+}
+
+/*
+ * Draws the values of the tbs arguments of a replicate from their uniform priors. They come from a substream of
+ * their own, so they only depend on the replicate.
+ *
+ * @param replicate replicate id
+ * @param values where the values are stored
+ */
+void
+drawPriors(int replicate, double *values)
+{
+    int k;
+
+    replicateSubstream(replicate, PRIOR_SUBSTREAM);
+    for(k=0; k<tbs.count; k++)
+        values[k] = tbs.priors[2*k] + (tbs.priors[2*k+1] - tbs.priors[2*k]) * ran1();
+}
+
+/*
+ * Reduces a sample to its statistics and decides whether it is accepted: the distance to the observed statistics,
+ * each one relative to its observed value unless that is 0, is at most the tolerance. The statistics are worked out
+ * from the count of derived alleles of every site, as sample_stats does.
+ *
+ * @param row the tbs values of the replicate, followed by room for the statistics
+ * @param gametes haplotypes of the sample, as '0' and '1' characters
+ * @param segsites segregating sites of the sample
+ * @param parameters simulation parameters
+ * @param length where the length of the record is stored
+ *
+ * @return an ABC record: the row if the sample is accepted, empty otherwise
+ */
+char *
+rejectSample(double *row, char **gametes, int segsites, struct params parameters, size_t *length)
+{
+    struct sampleRecord header;
+    double *statistics = row + tbs.count;
+    double n = parameters.cp.nsam, p, pi = 0.0, hsum = 0.0, squares = 0.0, distance = 0.0, scale;
+    int i, s, *counts = (int *) calloc(segsites + 1, sizeof(int));
+    char *record;
+
+    for(i=0; i<parameters.cp.nsam; i++)
+        for(s=0; s<segsites; s++)
+            if(gametes[i][s] == '1') counts[s]++;
+    for(s=0; s<segsites; s++)
+    {
+        p = counts[s] / n;
+        pi += 2.0 * p * (1.0 - p) * n / (n - 1.0);
+        hsum += 2.0 * p * (2.0 * p - 1.0) * n / (n - 1.0);
+        squares += (double) counts[s] * counts[s];
+    }
+    free(counts);
+
+    for(i=0; i<abc.count; i++)
+    {
+        switch(abc.statistics[i])
+        {
+            case ABC_PI: statistics[i] = pi; break;
+            case ABC_SEGSITES: statistics[i] = segsites; break;
+            case ABC_TAJIMA_D: statistics[i] = tajd(parameters.cp.nsam, segsites, pi); break;
+            case ABC_THETA_H: statistics[i] = squares * 2.0 / (n * (n - 1.0)); break;
+            case ABC_FAY_H: statistics[i] = -hsum; break;
+        }
+        scale = abc.observed[i] != 0.0 ? fabs(abc.observed[i]) : 1.0;
+        distance += (statistics[i] - abc.observed[i]) * (statistics[i] - abc.observed[i]) / (scale * scale);
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.flags = RECORD_ABC;
+    header.segsites = segsites;
+    header.nsam = parameters.cp.nsam;
+    header.length = sizeof(header);
+    if(sqrt(distance) <= abc.tolerance) header.length += (tbs.count + abc.count) * sizeof(double);
+
+    record = (char *) malloc(header.length);
+    memcpy(record, &header, sizeof(header));
+    memcpy(record + sizeof(header), row, header.length - sizeof(header));
+    *length = header.length;
+    return record;
+}
+
+// **************************************  //
+// RESULT CACHE
+// **************************************  //
+
+/*
+ * Opens the result cache (--cache) and serves the replicates it holds from the first one on. The cache keeps the
+ * sample records of blocks of CACHE_BLOCK replicates, under a hash of everything they depend on (see cacheKey); since
+ * every replicate is generated from its own RNG stream, a block is the same in any run that shares that. Blocks are
+ * served for as long as they follow one another, and the run goes on generating from the first one missing; the
+ * blocks it generates are stored as they are written out. Since a run is only served from its first block on, the
+ * cache gives up the blocks of a run from its last one backwards (see evictBlocks).
+ *
+ * @param options mspar's command line options
+ * @param howmany replicates of the run
+ * @param first first replicate to be written out
+ * @param parameters simulation parameters
+ * @param seeds RNG seeds of the run
+ *
+ * @return the first replicate still to be generated
+ */
+int
+openCache(struct msparOptions options, int howmany, int first, struct params parameters, unsigned short *seeds)
+{
+    int block;
+
+    if(mkdir(options.cache, 0777) != 0 && errno != EEXIST)
+    {
+        fprintf(stderr, " can't create the cache directory %s\n", options.cache);
+        abortRun();
+    }
+    cache.directory = options.cache;
+    cache.limit = options.cacheSize;
+    cache.parameters = parameters;
+    memcpy(cache.seeds, seeds, sizeof(cache.seeds));
+    cache.howmany = howmany;
+
+    for(block = first / CACHE_BLOCK; first < howmany && loadBlock(block, first); block++)
+        first = (block + 1) * CACHE_BLOCK < howmany ? (block + 1) * CACHE_BLOCK : howmany;
+    checkpointLedger(first);
+
+    cache.next = first;
+    cache.complete = first % CACHE_BLOCK == 0;
+    cache.storing = 1;
+    return first;
+}
+
+/* Closes the result cache, reporting how it did on stderr. */
+void
+closeCache()
+{
+    if(cache.directory == NULL) return;
+    fprintf(stderr, " cache: %d blocks hit (%d replicates), %d missed, %d stored, %d evicted\n",
+            cache.hits, cache.served, cache.misses, cache.stored, cache.evicted);
+    free(cache.block);
+    cache.directory = NULL;
+}
+
+/*
+ * Builds the key of a block of the cache: the format of the records, the seeds, every input the replicates are
+ * generated from and the replicates of the block, laid out field by field so the key does not depend on pointers or
+ * padding. The part of the key up to the replicates of the block is the same for every block of the run.
+ *
+ * @param first replicate id of the first replicate of the block
+ * @param count replicates of the block
+ * @param length where the length of the key is stored
+ * @param runLength where the length of the part of the key shared by the blocks of the run is stored
+ *
+ * @return the key
+ */
+char *
+cacheKey(int first, int count, size_t *length, size_t *runLength)
+{
+    char *key = NULL;
+    const char *text;
+    size_t textLength;
+    int i;
+
+    *length = 0;
+    keyAppend(&key, length, CACHE_FORMAT, strlen(CACHE_FORMAT) + 1);
+    keyAppend(&key, length, cache.seeds, sizeof(cache.seeds));
+    keyParameters(&key, length, cache.parameters);
+
+    for(i=0; i<sweep.count; i++)
+    {
+        keyParameters(&key, length, sweep.sets[i].parameters);
+        keyAppend(&key, length, &sweep.sets[i].howmany, sizeof(int));
+    }
+
+    for(i=0; i<tbs.count; i++)
+    {
+        keyAppend(&key, length, &tbs.bindings[i].field, sizeof(enum tbsField));
+        keyAppend(&key, length, &tbs.bindings[i].i, sizeof(int));
+        keyAppend(&key, length, &tbs.bindings[i].j, sizeof(int));
+    }
+    if(tbs.priors != NULL)
+        keyAppend(&key, length, tbs.priors, 2 * tbs.count * sizeof(double));
+
+    keyAppend(&key, length, abc.statistics, abc.count * sizeof(enum abcStatistic));
+    keyAppend(&key, length, abc.observed, abc.count * sizeof(double));
+    keyAppend(&key, length, &abc.tolerance, sizeof(double));
+
+    *runLength = *length;
+    keyAppend(&key, length, &first, sizeof(int));
+    keyAppend(&key, length, &count, sizeof(int));
+    if(tbsFromInput())
+    {
+        requireTbs(first + count);
+        pthread_mutex_lock(&tbsLock);
+        text = tbsText(first, count, &textLength);
+        keyAppend(&key, length, text, textLength);
+        pthread_mutex_unlock(&tbsLock);
+    }
+    return key;
+}
+
+/* Appends count bytes to a key being built. */
+void
+keyAppend(char **key, size_t *length, const void *bytes, size_t count)
+{
+    *key = (char *) realloc(*key, *length + count);
+    if(count > 0) memcpy(*key + *length, bytes, count);
+    *length += count;
+}
+
+/* Appends the simulation parameters to a key being built, the arrays and events they point to included. */
+void
+keyParameters(char **key, size_t *length, struct params parameters)
+{
+    struct c_params *cp = &parameters.cp;
+    struct m_params *mp = &parameters.mp;
+    struct devent *event;
+    int i;
+
+    keyAppend(key, length, &cp->nsam, sizeof(int));
+    keyAppend(key, length, &cp->npop, sizeof(int));
+    keyAppend(key, length, cp->config, cp->npop * sizeof(int));
+    for(i=0; i<cp->npop; i++) keyAppend(key, length, cp->mig_mat[i], cp->npop * sizeof(double));
+    keyAppend(key, length, &cp->r, sizeof(double));
+    keyAppend(key, length, &cp->nsites, sizeof(int));
+    keyAppend(key, length, &cp->f, sizeof(double));
+    keyAppend(key, length, &cp->track_len, sizeof(double));
+    keyAppend(key, length, cp->size, cp->npop * sizeof(double));
+    keyAppend(key, length, cp->alphag, cp->npop * sizeof(double));
+    for(event = cp->deventlist; event != NULL; event = event->nextde)
+    {
+        keyAppend(key, length, &event->detype, sizeof(char));
+        keyAppend(key, length, &event->time, sizeof(double));
+        keyAppend(key, length, &event->popi, sizeof(int));
+        keyAppend(key, length, &event->popj, sizeof(int));
+        keyAppend(key, length, &event->paramv, sizeof(double));
+        // -ema keeps the size of its matrix in popi
+        if(event->detype == 'a')
+            for(i=0; i<event->popi; i++) keyAppend(key, length, event->mat[i], event->popi * sizeof(double));
+    }
+    keyAppend(key, length, &mp->theta, sizeof(double));
+    keyAppend(key, length, &mp->segsitesin, sizeof(int));
+    keyAppend(key, length, &mp->treeflag, sizeof(int));
+    keyAppend(key, length, &mp->timeflag, sizeof(int));
+    keyAppend(key, length, &mp->mfreq, sizeof(int));
+    keyAppend(key, length, &parameters.output_precision, sizeof(int));
+}
+
+/*
+ * Gets the path of the file of a block in the cache, named after the hash (64 bit FNV-1a) of the part of its key
+ * shared by the blocks of its run and the index of the block, so the blocks of a run are told from the name alone.
+ * The file holds the whole key too, so a collision, or a block of a run with other tbs values, is told apart from a
+ * hit.
+ *
+ * @param key key of the block
+ * @param runLength length of the part of the key shared by the blocks of the run
+ * @param block index of the block
+ *
+ * @return the path
+ */
+char *
+cachePath(const char *key, size_t runLength, int block)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    char *path = (char *) malloc(strlen(cache.directory) + 40);
+    size_t i;
+
+    for(i=0; i<runLength; i++) hash = (hash ^ (unsigned char) key[i]) * 1099511628211ULL;
+    sprintf(path, "%s/%016llx-%d.block", cache.directory, hash, block);
+    return path;
+}
+
+/*
+ * Serves a block from the cache, writing out its replicates from the first one on.
+ *
+ * @param block index of the block
+ * @param first first replicate of the block to be written out
+ *
+ * @return 1 if the block was in the cache, 0 otherwise
+ */
+int
+loadBlock(int block, int first)
+{
+    struct sampleRecord header;
+    int replicate, records = 0, hit = 0;
+    int start = block * CACHE_BLOCK, count = cache.howmany - start < CACHE_BLOCK ? cache.howmany - start : CACHE_BLOCK;
+    size_t keyLength, runLength, storedLength, size = 0, offset = 0;
+    char *key = cacheKey(start, count, &keyLength, &runLength), *path = cachePath(key, runLength, block);
+    char *stored = NULL, *contents = NULL;
+    FILE *file = fopen(path, "r");
+
+    if(file != NULL && fread(&storedLength, sizeof(size_t), 1, file) == 1 && storedLength == keyLength)
+    {
+        stored = (char *) malloc(keyLength);
+        if(fread(stored, sizeof(char), keyLength, file) == keyLength && memcmp(stored, key, keyLength) == 0
+           && fseeko(file, 0, SEEK_END) == 0)
+        {
+            size = ftello(file) - sizeof(size_t) - keyLength;
+            contents = (char *) malloc(size);
+            fseeko(file, sizeof(size_t) + keyLength, SEEK_SET);
+            if(fread(contents, sizeof(char), size, file) == size)
+            {
+                // A block cut short, by a full disk say, is a miss
+                for(; offset + sizeof(header) <= size; offset += header.length, records++)
+                {
+                    memcpy(&header, contents + offset, sizeof(header));
+                    if(header.length < sizeof(header)) break;
+                }
+                hit = offset == size && records == count;
+            }
+        }
+    }
+    if(file != NULL) fclose(file);
+
+    if(hit)
+    {
+        for(offset = 0, replicate = start; replicate < start + count; replicate++, offset += header.length)
+        {
+            memcpy(&header, contents + offset, sizeof(header));
+            if(replicate < first) continue;
+            renderSample(contents + offset);
+            cache.served++;
+        }
+        utime(path, NULL);
+        cache.hits++;
+    }
+
+    free(contents);
+    free(stored);
+    free(path);
+    free(key);
+    return hit;
+}
+
+/*
+ * Keeps a record being written out in the block it belongs to, and stores the block once it is complete.
+ *
+ * @param record the sample record
+ */
+void
+cacheRecord(const char *record)
+{
+    struct sampleRecord header;
+
+    memcpy(&header, record, sizeof(header));
+    if(cache.length + header.length > cache.capacity)
+    {
+        cache.capacity = 2 * (cache.length + header.length);
+        cache.block = (char *) realloc(cache.block, cache.capacity);
+    }
+    memcpy(cache.block + cache.length, record, header.length);
+    cache.length += header.length;
+
+    cache.next++;
+    if(cache.next % CACHE_BLOCK == 0 || cache.next == cache.howmany)
+    {
+        // a block resumed halfway through lacks its first records
+        if(cache.complete) storeBlock((cache.next - 1) / CACHE_BLOCK);
+        cache.misses++;
+        cache.length = 0;
+        cache.complete = 1;
+    }
+}
+
+/*
+ * Stores the block just written out in the cache. It is written aside and renamed into place, so runs sharing the
+ * cache never see a block halfway written.
+ *
+ * @param block index of the block
+ */
+void
+storeBlock(int block)
+{
+    size_t keyLength, runLength;
+    int start = block * CACHE_BLOCK;
+    char *key = cacheKey(start, cache.next - start, &keyLength, &runLength), *path = cachePath(key, runLength, block);
+    char *temporary = (char *) malloc(strlen(path) + 32);
+    FILE *file;
+    int written;
+
+    sprintf(temporary, "%s.%d.tmp", path, (int) getpid());
+    if((file = fopen(temporary, "w")) != NULL)
+    {
+        written = fwrite(&keyLength, sizeof(size_t), 1, file) == 1
+                  && fwrite(key, sizeof(char), keyLength, file) == keyLength
+                  && fwrite(cache.block, sizeof(char), cache.length, file) == cache.length;
+        if(fclose(file) == 0 && written && rename(temporary, path) == 0)
+        {
+            cache.stored++;
+            evictBlocks();
+        }
+        else
+            remove(temporary);
+    }
+
+    free(temporary);
+    free(path);
+    free(key);
+}
+
+/*
+ * Removes blocks from the cache while it takes up more than its limit. A run is only served from its first block on
+ * (see openCache), so a block is worth keeping as long as the ones before it are: the runs used least recently go
+ * first, each one from its last block backwards. The run being generated was used last, and keeps its first blocks.
+ */
+void
+evictBlocks()
+{
+    DIR *directory = opendir(cache.directory);
+    struct dirent *entry;
+    struct stat status;
+    struct cachedBlock *blocks = NULL;
+    int i, j, count = 0;
+    long long total = 0;
+    double used;
+    size_t length;
+    char *path;
+
+    if(directory == NULL) return;
+    while((entry = readdir(directory)) != NULL)
+    {
+        length = strlen(entry->d_name);
+        if(length < 6 || strcmp(entry->d_name + length - 6, ".block") != 0) continue;
+
+        path = (char *) malloc(strlen(cache.directory) + length + 2);
+        sprintf(path, "%s/%s", cache.directory, entry->d_name);
+        if(stat(path, &status) != 0)
+        {
+            free(path);
+            continue;
+        }
+        blocks = (struct cachedBlock *) realloc(blocks, (count + 1) * sizeof(struct cachedBlock));
+        blocks[count].path = path;
+        blocks[count].used = status.st_mtim.tv_sec + status.st_mtim.tv_nsec * 1e-9;
+        blocks[count].size = status.st_size;
+        // blocks of older formats have no run, and go first
+        if(sscanf(entry->d_name, "%llx-%d.block", &blocks[count].run, &blocks[count].index) != 2)
+        {
+            blocks[count].run = 0;
+            blocks[count].index = 0;
+            blocks[count].used = 0.0;
+        }
+        total += status.st_size;
+        count++;
+    }
+    closedir(directory);
+
+    // Every block of a run takes the last time any of them was used
+    qsort(blocks, count, sizeof(struct cachedBlock), compareCachedRuns);
+    for(i=0; i<count; i=j)
+    {
+        for(j=i, used=0.0; j<count && blocks[j].run == blocks[i].run; j++)
+            if(blocks[j].used > used) used = blocks[j].used;
+        for(j=i; j<count && blocks[j].run == blocks[i].run; j++) blocks[j].used = used;
+    }
+
+    qsort(blocks, count, sizeof(struct cachedBlock), compareCachedBlocks);
+    for(i=0; i<count; i++)
+    {
+        if(total > cache.limit && unlink(blocks[i].path) == 0)
+        {
+            total -= blocks[i].size;
+            cache.evicted++;
+        }
+        free(blocks[i].path);
+    }
+    free(blocks);
+}
+
+/* Orders the blocks of the cache by run. */
+int
+compareCachedRuns(const void *a, const void *b)
+{
+    const struct cachedBlock *x = a, *y = b;
+
+    return x->run < y->run ? -1 : x->run > y->run;
+}
+
+/* Orders the blocks of the cache in eviction order: from the least recently used run, and within a run backwards. */
+int
+compareCachedBlocks(const void *a, const void *b)
+{
+    const struct cachedBlock *x = a, *y = b;
+
+    if(x->used != y->used) return x->used < y->used ? -1 : 1;
+    if(x->run != y->run) return x->run < y->run ? -1 : 1;
+    return y->index - x->index;
+}
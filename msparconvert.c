@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ms.h"
+#include "mspar.h"
+
+/*
+ * mspar-convert: prints the binary output of mspar or mspar-threads (--binary) as the ms output the same run would
+ * have printed, byte for byte, so the tools reading ms output can read it. It streams: a record is printed as soon as
+ * it is read. Binary output is written in the same byte order everywhere, so it may be converted on any machine.
+ *
+ *    mspar-convert [file]     (the standard input without file)
+ */
+
+int
+main(int argc, char *argv[])
+{
+    FILE *input = stdin;
+    struct outputBuffer record = { NULL, 0, 0 };
+    char magic[sizeof(BINARY_MAGIC)] = "";
+    unsigned char order[4];
+    int c, read;
+
+    if(argc > 2)
+    {
+        fprintf(stderr, "usage: %s [file]\n", argv[0]);
+        return 1;
+    }
+    if(argc == 2 && (input = fopen(argv[1], "rb")) == NULL)
+    {
+        fprintf(stderr, " can't open %s\n", argv[1]);
+        return 1;
+    }
+
+    if(fread(magic, sizeof(char), strlen(BINARY_MAGIC), input) != strlen(BINARY_MAGIC)
+       || memcmp(magic, BINARY_MAGIC, strlen(BINARY_MAGIC)) != 0)
+    {
+        // Same line but another version
+        if(memcmp(magic, BINARY_MAGIC, strlen(BINARY_MAGIC) - 2) == 0)
+            fprintf(stderr, " the input is binary output of another version of mspar\n");
+        else
+            fprintf(stderr, " the input is not binary output of mspar (--binary)\n");
+        return 1;
+    }
+    if(fread(order, 1, sizeof(order), input) != sizeof(order) || littleEndian(order, 4) != BINARY_BYTE_ORDER)
+    {
+        fprintf(stderr, " the input holds a broken byte order mark\n");
+        return 1;
+    }
+
+    // The header goes through as it is
+    while((c = getc(input)) != '\0' && c != EOF) putchar(c);
+    if(c == EOF)
+    {
+        fprintf(stderr, " the input ends within its header\n");
+        return 1;
+    }
+
+    while((read = readBinaryRecord(input, &record)) == 1) printSample(record.text);
+    // The input must end right after a record
+    if(read < 0)
+    {
+        fprintf(stderr, " the input ends within a record, or holds a broken one\n");
+        return 1;
+    }
+
+    free(record.text);
+    if(input != stdin) fclose(input);
+    return 0;
+}
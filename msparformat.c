@@ -0,0 +1,385 @@
+// Largest precision formatFixed handles; longer ones go through printf
+const int FIXED_PRECISION_LIMIT = 15;
+
+// Bytes of the header of a record in binary output: its length (64 bits), six 32 bit fields and probss (64 bits)
+const int BINARY_HEADER_LENGTH = 40;
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include "ms.h"
+#include "mspar.h"
+
+/*
+ * Formatting of the output: sample records printed as ms output or written as binary output, the text buffers it is
+ * built in, and the fixed-precision formatting of its numbers (positions, branch lengths), which is where rendering
+ * spends most of its time when done with printf. Depends on nothing else of mspar, so mspar-convert reads and renders
+ * binary output with it too.
+ */
+
+// **************************************  //
+// SAMPLES
+// **************************************  //
+
+/*
+ * Prints a sample record to the standard output as ms does:
+ *    //, followed by the tbs values (each one after a tab) if there are any
+ *    segsites: xxx
+ *    positions: 0.xxxxx 0.xxxxx .... etc.
+ *    gametes, one line per haplotype
+ *
+ * @param record the sample record
+ */
+void
+printSample(const char *record)
+{
+    struct sampleRecord header;
+    const char *trees, *columns;
+    double position, value;
+    char *row;
+    int i, j, columnSize;
+    static struct outputBuffer positions;   // the positions line, reused sample after sample
+
+    memcpy(&header, record, sizeof(header));
+    if(header.flags & RECORD_ABC)
+    {
+        for(i=0; i < (int) ((header.length - sizeof(header)) / sizeof(double)); i++)
+        {
+            memcpy(&value, record + sizeof(header) + i * sizeof(double), sizeof(double));
+            printf(i == 0 ? "%lf" : "\t%lf", value);
+        }
+        if(i > 0) putchar('\n');
+        return;
+    }
+    trees = record + sizeof(header) + header.tbsLength;
+    columns = trees + header.treesLength + header.segsites * sizeof(double);
+    columnSize = (header.nsam + 7) / 8;
+
+    fputs("\n//", stdout);
+    fwrite(record + sizeof(header), sizeof(char), header.tbsLength, stdout);
+    if(header.flags & RECORD_SEGSITES)
+    {
+        if(header.flags & RECORD_TREES)
+            fwrite(trees, sizeof(char), header.treesLength, stdout);
+        else
+            putchar('\n');
+        if(header.flags & RECORD_PROB)
+            printf("prob: %g\n", header.probss);
+        printf("segsites: %d\n", header.segsites);
+    }
+    if(header.segsites == 0) return;
+
+    positions.length = 0;
+    bufferAppend(&positions, "positions: ", strlen("positions: "));
+    for(i=0; i<header.segsites; i++)
+    {
+        memcpy(&position, trees + header.treesLength + i * sizeof(double), sizeof(double));
+        bufferFixed(&positions, position, 6, header.precision);
+        bufferAppend(&positions, " ", 1);
+    }
+    bufferAppend(&positions, "\n", 1);
+    fwrite(positions.text, sizeof(char), positions.length, stdout);
+
+    row = (char *) malloc(header.segsites + 1);
+    row[header.segsites] = '\n';
+    for(i=0; i<header.nsam; i++)
+    {
+        for(j=0; j<header.segsites; j++)
+            row[j] = columns[j * columnSize + i / 8] & (1 << (i % 8)) ? '1' : '0';
+        fwrite(row, sizeof(char), header.segsites + 1, stdout);
+    }
+    free(row);
+}
+
+// **************************************  //
+// BINARY OUTPUT
+// **************************************  //
+
+/*
+ * Writes a sample record to binary output (--binary). Records are kept in memory as the machine lays them out;
+ * binary output is meant to be read anywhere, so its records are written field by field, with fixed-width fields in
+ * little-endian byte order and no padding:
+ *    length      64 bits, bytes of the record in binary output, its header included
+ *    flags, segsites, nsam, precision, tbsLength, treesLength     32 bits each
+ *    probss      64 bits, as an IEEE 754 double
+ * followed by the tbs values and trees text, the positions (doubles, as probss) and the haplotype columns as they
+ * are. The rows of ABC records are doubles too.
+ *
+ * @param record the sample record
+ * @param output where the record is written
+ */
+void
+writeBinaryRecord(const char *record, FILE *output)
+{
+    struct sampleRecord header;
+    const char *payload;
+    size_t doubles, i;
+    uint64_t bits;
+    static struct outputBuffer written;     // the record as it is written, reused record after record
+
+    memcpy(&header, record, sizeof(header));
+    payload = record + sizeof(header);
+    if(header.flags & RECORD_ABC)
+        doubles = (header.length - sizeof(header)) / sizeof(double);
+    else
+        doubles = header.segsites;
+
+    written.length = 0;
+    bufferLittleEndian(&written, BINARY_HEADER_LENGTH + header.length - sizeof(header), 8);
+    bufferLittleEndian(&written, header.flags, 4);
+    bufferLittleEndian(&written, header.segsites, 4);
+    bufferLittleEndian(&written, header.nsam, 4);
+    bufferLittleEndian(&written, header.precision, 4);
+    bufferLittleEndian(&written, header.tbsLength, 4);
+    bufferLittleEndian(&written, header.treesLength, 4);
+    memcpy(&bits, &header.probss, sizeof(bits));
+    bufferLittleEndian(&written, bits, 8);
+
+    if(!(header.flags & RECORD_ABC))
+    {
+        bufferAppend(&written, payload, header.tbsLength + header.treesLength);
+        payload += header.tbsLength + header.treesLength;
+    }
+    for(i=0; i<doubles; i++, payload += sizeof(double))
+    {
+        memcpy(&bits, payload, sizeof(bits));
+        bufferLittleEndian(&written, bits, 8);
+    }
+    bufferAppend(&written, payload, record + header.length - payload);
+    fwrite(written.text, sizeof(char), written.length, output);
+}
+
+/*
+ * Reads a record of binary output (see writeBinaryRecord) back into a sample record as this machine lays them out.
+ * The record is checked to hold the fields its header tells, so a broken record is never rendered.
+ *
+ * @param input where the record is read from
+ * @param record where the sample record is stored, grown as needed
+ *
+ * @return 1 if a record was read, 0 if the input ended right before a record, -1 if it ended within one or the
+ *         record is broken
+ */
+int
+readBinaryRecord(FILE *input, struct outputBuffer *record)
+{
+    struct sampleRecord header;
+    unsigned char fields[BINARY_HEADER_LENGTH];
+    uint64_t length, bits;
+    size_t read, payload, doubles, columnSize, i;
+    char *values;
+
+    if((read = fread(fields, 1, BINARY_HEADER_LENGTH, input)) != (size_t) BINARY_HEADER_LENGTH)
+        return read == 0 && !ferror(input) ? 0 : -1;
+
+    memset(&header, 0, sizeof(header));
+    length = littleEndian(fields, 8);
+    header.flags = littleEndian(fields + 8, 4);
+    header.segsites = littleEndian(fields + 12, 4);
+    header.nsam = littleEndian(fields + 16, 4);
+    header.precision = littleEndian(fields + 20, 4);
+    header.tbsLength = littleEndian(fields + 24, 4);
+    header.treesLength = littleEndian(fields + 28, 4);
+    bits = littleEndian(fields + 32, 8);
+    memcpy(&header.probss, &bits, sizeof(bits));
+
+    if(length < (uint64_t) BINARY_HEADER_LENGTH || header.segsites < 0 || header.nsam < 0 || header.tbsLength < 0
+       || header.treesLength < 0)
+        return -1;
+    payload = length - BINARY_HEADER_LENGTH;
+    columnSize = (header.nsam + 7) / 8;
+    if(header.flags & RECORD_ABC)
+    {
+        if(payload % sizeof(double) != 0) return -1;
+        doubles = payload / sizeof(double);
+    }
+    else
+    {
+        doubles = header.segsites;
+        if(payload != (size_t) header.tbsLength + header.treesLength + doubles * (sizeof(double) + columnSize))
+            return -1;
+    }
+
+    header.length = sizeof(header) + payload;
+    record->length = 0;
+    bufferReserve(record, header.length);
+    memcpy(record->text, &header, sizeof(header));
+    if(fread(record->text + sizeof(header), 1, payload, input) != payload) return -1;
+    record->length = header.length;
+
+    values = record->text + sizeof(header) + (header.flags & RECORD_ABC ? 0 : header.tbsLength + header.treesLength);
+    for(i=0; i<doubles; i++, values += sizeof(double))
+    {
+        bits = littleEndian((const unsigned char *) values, 8);
+        memcpy(values, &bits, sizeof(bits));
+    }
+    return 1;
+}
+
+/*
+ * Appends an unsigned integer to a buffer in little-endian byte order.
+ *
+ * @param buffer the buffer
+ * @param value the integer
+ * @param count bytes it is written in
+ */
+void
+bufferLittleEndian(struct outputBuffer *buffer, uint64_t value, int count)
+{
+    unsigned char bytes[8];
+    int i;
+
+    for(i=0; i<count; i++, value >>= 8) bytes[i] = value & 0xff;
+    bufferAppend(buffer, (const char *) bytes, count);
+}
+
+/* Reads an unsigned integer of the given number of bytes, stored in little-endian byte order. */
+uint64_t
+littleEndian(const unsigned char *bytes, int count)
+{
+    uint64_t value = 0;
+
+    while(count-- > 0) value = value << 8 | bytes[count];
+    return value;
+}
+
+// **************************************  //
+// BUFFERS
+// **************************************  //
+
+/*
+ * Makes room in a buffer for length more bytes and the terminating null. The buffer grows geometrically, so building a
+ * text of n bytes takes O(n) time however many pieces it comes in.
+ *
+ * @param buffer the buffer
+ * @param length bytes to be appended
+ */
+void
+bufferReserve(struct outputBuffer *buffer, size_t length)
+{
+    if(buffer->length + length + 1 <= buffer->capacity) return;
+    if(buffer->capacity == 0) buffer->capacity = 256;
+    while(buffer->length + length + 1 > buffer->capacity) buffer->capacity *= 2;
+    buffer->text = (char *) realloc(buffer->text, buffer->capacity);
+}
+
+/*
+ * Appends text to a buffer.
+ *
+ * @param buffer the buffer
+ * @param text text to be appended
+ * @param length length of the text
+ */
+void
+bufferAppend(struct outputBuffer *buffer, const char *text, size_t length)
+{
+    bufferReserve(buffer, length);
+    memcpy(buffer->text + buffer->length, text, length);
+    buffer->length += length;
+    buffer->text[buffer->length] = '\0';
+}
+
+/*
+ * Appends formatted text to a buffer, as printf would print it.
+ *
+ * @param buffer the buffer
+ * @param format printf format
+ */
+void
+bufferPrintf(struct outputBuffer *buffer, const char *format, ...)
+{
+    va_list arguments;
+    int length;
+
+    va_start(arguments, format);
+    length = vsnprintf(NULL, 0, format, arguments);
+    va_end(arguments);
+
+    bufferReserve(buffer, length);
+    va_start(arguments, format);
+    vsnprintf(buffer->text + buffer->length, length + 1, format, arguments);
+    va_end(arguments);
+    buffer->length += length;
+}
+
+/*
+ * Appends a number to a buffer, as printf("%*.*f", width, precision, value) would print it. The numbers formatFixed
+ * handles skip printf; the rest, of whatever length, go through bufferPrintf.
+ *
+ * @param buffer the buffer
+ * @param value the number
+ * @param width minimum width
+ * @param precision digits after the decimal point
+ */
+void
+bufferFixed(struct outputBuffer *buffer, double value, int width, int precision)
+{
+    int length;
+
+    bufferReserve(buffer, FIXED_LENGTH);
+    if((length = formatFixed(buffer->text + buffer->length, value, width, precision)) >= 0)
+        buffer->length += length;
+    else
+        bufferPrintf(buffer, "%*.*f", width, precision, value);
+}
+
+// **************************************  //
+// NUMBERS
+// **************************************  //
+
+static const double powersOfTen[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13,
+                                      1e14, 1e15 };
+
+/*
+ * Formats a number as printf("%*.*f", width, precision, value) does, byte for byte.
+ *
+ * Non-negative values whose scaled value (value * 10^precision) is below 2^53 take the fast path: the scaled value is
+ * split into its closest double and the rounding error of that product, which together tell exactly which side of
+ * the halfway point between two integers it lies on, and the rounded integer is written out digit by digit. Exact
+ * ties (and the values near enough to one that the side is unclear), negative numbers and everything else are left
+ * to printf, so the rounding is always the C library's: nothing is written for them.
+ *
+ * @param text where the text is written, at least FIXED_LENGTH bytes
+ * @param value the number
+ * @param width minimum width, padded with spaces on the left
+ * @param precision digits after the decimal point
+ *
+ * @return length of the text (the terminating null excluded), or -1 if the number is left to printf
+ */
+int
+formatFixed(char *text, double value, int width, int precision)
+{
+    char digits[FIXED_LENGTH];
+    double scaled, error, fraction;
+    uint64_t rounded;
+    int length = 0, padding;
+
+    if(precision < 0 || precision > FIXED_PRECISION_LIMIT || !(value >= 0.0) || signbit(value)
+       || width >= FIXED_LENGTH - 24)
+        return -1;
+
+    scaled = value * powersOfTen[precision];
+    if(scaled >= 9007199254740992.0)
+        return -1;
+    error = fma(value, powersOfTen[precision], -scaled);
+    rounded = (uint64_t) scaled;
+    fraction = (scaled - rounded) + error - 0.5;
+    if(fabs(fraction) < 1e-9)
+        return -1;
+    if(fraction > 0) rounded++;
+
+    // Digits from the last one backwards: the decimals, the point, and the integer part (at least a 0)
+    do
+    {
+        if(length == precision && precision > 0) digits[length++] = '.';
+        digits[length++] = '0' + rounded % 10;
+        rounded /= 10;
+    } while(rounded > 0 || length <= precision);
+
+    for(padding = 0; padding < width - length; padding++) text[padding] = ' ';
+    while(length > 0) text[padding++] = digits[--length];
+    text[padding] = '\0';
+    return padding;
+}
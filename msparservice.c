@@ -0,0 +1,381 @@
+#define _GNU_SOURCE
+
+// Connections waiting to be accepted by the service
+const int SERVICE_BACKLOG = 64;
+
+// Descriptors a client hands over with its job: stdin, stdout and stderr
+const int JOB_DESCRIPTORS = 3;
+
+// Largest working directory and arguments of a job, in bytes, well beyond what a command line may take
+const int JOB_LENGTH_LIMIT = 16 << 20;
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include "ms.h"
+#include "mspar.h"
+
+/*
+ * mspar-threads as a local service: `mspar-threads --serve socket` stays up listening on a Unix socket, and
+ * `mspar-threads --connect socket <arguments>` hands a job over to it instead of running it.
+ *
+ * A job is the client's command line and working directory, along with its stdin, stdout and stderr, so the job
+ * reads its tbs values and writes its output and errors just as if the client had run it. The service keeps a pool
+ * of worker processes, one per core, started along with it and taking jobs from the socket one at a time for as long
+ * as it runs. A worker runs every job it takes in a process forked for it alone: the simulator keeps its state in
+ * globals, and a fresh copy of them per job is both cheaper and safer than resetting them. The client exits with the
+ * job's exit status.
+ *
+ * Protocol, on a stream socket: the client sends a struct serviceJob with its descriptors attached (SCM_RIGHTS),
+ * followed by its working directory and arguments as length bytes of NUL terminated strings. The service answers
+ * with the job's exit status, an int, once the job is over.
+ *
+ * A job runs with the service's rights, so only the user running the service may hand jobs over: the socket is
+ * reachable by that user alone, and the service checks who is at the other end of every connection too.
+ */
+
+// **************************************  //
+// SETUP
+// **************************************  //
+
+/*
+ * Takes a service option (--serve, --connect) out of the command line and acts on it:
+ *  - --connect socket: hands the rest of the command line over to the service as a job and exits with its status.
+ *  - --serve socket: runs the service, and returns in the process of every job with the job's command line.
+ * Without them, it returns at once.
+ *
+ * @param argc number of arguments, replaced by the job's
+ * @param argv the command line, replaced by the job's
+ */
+void
+serviceSetup(int *argc, char ***argv)
+{
+    int arg, serve;
+    char *path;
+
+    for(arg=1; arg + 1 < *argc; arg++)
+        if(strcmp((*argv)[arg], "--connect") == 0 || strcmp((*argv)[arg], "--serve") == 0) break;
+    if(arg + 1 >= *argc) return;
+
+    serve = strcmp((*argv)[arg], "--serve") == 0;
+    path = (*argv)[arg + 1];
+    // drops the option and its value, moving the NULL that ends the arguments along
+    memmove(&(*argv)[arg], &(*argv)[arg + 2], (*argc - arg - 1) * sizeof(char *));
+    *argc -= 2;
+
+    if(serve)
+        serveJobs(path, argc, argv);
+    else
+        exit(submitJob(path, *argc, *argv));
+}
+
+// **************************************  //
+// SERVICE
+// **************************************  //
+
+/*
+ * Main loop of the service: starts its workers, and starts them again should any of them die. Never returns but in
+ * the processes of the jobs.
+ *
+ * @param path the socket
+ * @param argc where the number of arguments of a job is stored
+ * @param argv where the command line of a job is stored
+ */
+void
+serveJobs(const char *path, int *argc, char ***argv)
+{
+    struct sockaddr_un address;
+    int service, bound, running, workers = sysconf(_SC_NPROCESSORS_ONLN);
+    pid_t server = getpid();
+    mode_t mask;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, " the socket path %s is too long\n", path);
+        exit(1);
+    }
+    strcpy(address.sun_path, path);
+
+    unlink(path);
+    service = socket(AF_UNIX, SOCK_STREAM, 0);
+    // The socket is created with no rights for anybody but its owner (0600)
+    mask = umask(0177);
+    bound = service >= 0 && bind(service, (struct sockaddr *) &address, sizeof(address)) == 0;
+    umask(mask);
+    if(!bound || listen(service, SERVICE_BACKLOG) != 0)
+    {
+        fprintf(stderr, " can't serve jobs on %s\n", path);
+        exit(1);
+    }
+
+    if(workers < 1) workers = 1;
+    for(running = 0; ; running--)
+    {
+        for(; running < workers; running++)
+        {
+            switch(fork())
+            {
+                case 0:
+                    // The workers go along with the service
+                    prctl(PR_SET_PDEATHSIG, SIGTERM);
+                    if(getppid() != server) _exit(0);
+                    serviceWorker(service, argc, argv);
+                    return;
+                case -1:
+                    fprintf(stderr, " can't start a worker of the service\n");
+                    if(running == 0) exit(1);
+                    workers = running;
+                    break;
+            }
+        }
+        wait(NULL);
+    }
+}
+
+/*
+ * Loop of a worker of the service: takes the jobs from the socket one at a time and runs them. Never returns but in
+ * the processes of the jobs.
+ *
+ * @param service the socket
+ * @param argc where the number of arguments of a job is stored
+ * @param argv where the command line of a job is stored
+ */
+void
+serviceWorker(int service, int *argc, char ***argv)
+{
+    int connection;
+
+    while(1)
+    {
+        if((connection = accept(service, NULL, NULL)) < 0) continue;
+        if(ownPeer(connection) && runJob(service, connection, argc, argv)) return;
+        close(connection);
+    }
+}
+
+/*
+ * Receives a job and runs it in a process of its own, reporting its exit status back to the client once it is
+ * over. In the process of the job, its descriptors, working directory and command line are put in place.
+ *
+ * @param service the socket, closed in the process of the job
+ * @param connection connection to the client
+ * @param argc where the number of arguments of the job is stored
+ * @param argv where the command line of the job is stored
+ *
+ * @return 1 in the process of the job, 0 in the worker once the job is over or found broken
+ */
+int
+runJob(int service, int connection, int *argc, char ***argv)
+{
+    struct serviceJob job;
+    int i, status, valid, descriptors[JOB_DESCRIPTORS];
+    char *payload = NULL, *text;
+    size_t strings = 0;
+    pid_t process;
+
+    if(receiveJob(connection, &job, descriptors) != 0) return 0;
+    valid = job.argc >= 1 && job.length > 0 && job.length <= (size_t) JOB_LENGTH_LIMIT
+            && (payload = (char *) malloc(job.length)) != NULL && receiveAll(connection, payload, job.length) == 0
+            && payload[job.length - 1] == '\0';
+    if(valid)
+    {
+        for(text = payload; text < payload + job.length; text++) if(*text == '\0') strings++;
+        valid = strings == (size_t) job.argc + 1;
+    }
+    if(!valid)
+    {
+        for(i=0; i<JOB_DESCRIPTORS; i++) close(descriptors[i]);
+        free(payload);
+        return 0;
+    }
+
+    if((process = fork()) == 0)
+    {
+        close(service);
+        close(connection);
+        prctl(PR_SET_PDEATHSIG, 0);
+        for(i=0; i<JOB_DESCRIPTORS; i++)
+        {
+            if(descriptors[i] == i) continue;
+            dup2(descriptors[i], i);
+            close(descriptors[i]);
+        }
+        if(chdir(payload) != 0)
+        {
+            fprintf(stderr, " can't change to the directory %s\n", payload);
+            exit(1);
+        }
+
+        *argc = job.argc;
+        *argv = (char **) malloc((job.argc + 1) * sizeof(char *));
+        for(i = 0, text = payload + strlen(payload) + 1; i < job.argc; i++, text += strlen(text) + 1)
+            (*argv)[i] = text;
+        (*argv)[job.argc] = NULL;
+        return 1;
+    }
+
+    for(i=0; i<JOB_DESCRIPTORS; i++) close(descriptors[i]);
+    if(process > 0 && waitpid(process, &status, 0) == process)
+        status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    else
+        status = 1;
+    sendAll(connection, &status, sizeof(status));
+    free(payload);
+    return 0;
+}
+
+/*
+ * Receives the header of a job, along with the client's descriptors.
+ *
+ * @param connection connection to the client
+ * @param job where the header is stored
+ * @param descriptors where the descriptors are stored
+ *
+ * @return 0, or -1 if the client did not send a job
+ */
+int
+receiveJob(int connection, struct serviceJob *job, int *descriptors)
+{
+    struct iovec data = { job, sizeof(struct serviceJob) };
+    struct msghdr message;
+    struct cmsghdr *control;
+    int received;
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_controllen = CMSG_SPACE(JOB_DESCRIPTORS * sizeof(int));
+    message.msg_control = malloc(message.msg_controllen);
+
+    received = recvmsg(connection, &message, MSG_WAITALL) == sizeof(struct serviceJob)
+               && (control = CMSG_FIRSTHDR(&message)) != NULL && control->cmsg_type == SCM_RIGHTS
+               && control->cmsg_len == CMSG_LEN(JOB_DESCRIPTORS * sizeof(int));
+    if(received) memcpy(descriptors, CMSG_DATA(control), JOB_DESCRIPTORS * sizeof(int));
+    free(message.msg_control);
+    return received ? 0 : -1;
+}
+
+/*
+ * Tells whether the client at the other end of a connection runs as the same user as the service.
+ *
+ * @param connection connection to the client
+ *
+ * @return 1 if it does, 0 otherwise
+ */
+int
+ownPeer(int connection)
+{
+    struct ucred credentials;
+    socklen_t length = sizeof(credentials);
+
+    return getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == 0
+           && length == sizeof(credentials) && credentials.uid == getuid();
+}
+
+// **************************************  //
+// CLIENT
+// **************************************  //
+
+/*
+ * Hands a job over to the service and waits for it to be over.
+ *
+ * @param path the socket of the service
+ * @param argc number of arguments of the job
+ * @param argv command line of the job
+ *
+ * @return the exit status of the job
+ */
+int
+submitJob(const char *path, int argc, char *argv[])
+{
+    struct sockaddr_un address;
+    struct serviceJob job;
+    struct iovec data = { &job, sizeof(job) };
+    struct msghdr message;
+    struct cmsghdr *control;
+    char *directory = getcwd(NULL, 0), *payload;
+    int i, client, status, descriptors[JOB_DESCRIPTORS];
+    size_t offset;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    client = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(client < 0 || connect(client, (struct sockaddr *) &address, sizeof(address)) != 0)
+    {
+        fprintf(stderr, " can't reach the service at %s\n", path);
+        return 1;
+    }
+
+    job.argc = argc;
+    job.length = strlen(directory) + 1;
+    for(i=0; i<argc; i++) job.length += strlen(argv[i]) + 1;
+    payload = (char *) malloc(job.length);
+    strcpy(payload, directory);
+    offset = strlen(directory) + 1;
+    for(i=0; i<argc; i++)
+    {
+        strcpy(payload + offset, argv[i]);
+        offset += strlen(argv[i]) + 1;
+    }
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_controllen = CMSG_SPACE(JOB_DESCRIPTORS * sizeof(int));
+    message.msg_control = calloc(1, message.msg_controllen);
+    control = CMSG_FIRSTHDR(&message);
+    control->cmsg_level = SOL_SOCKET;
+    control->cmsg_type = SCM_RIGHTS;
+    control->cmsg_len = CMSG_LEN(JOB_DESCRIPTORS * sizeof(int));
+    for(i=0; i<JOB_DESCRIPTORS; i++) descriptors[i] = i;
+    memcpy(CMSG_DATA(control), descriptors, JOB_DESCRIPTORS * sizeof(int));
+
+    if(sendmsg(client, &message, 0) != sizeof(job) || sendAll(client, payload, job.length) != 0
+       || receiveAll(client, &status, sizeof(status)) != 0)
+    {
+        fprintf(stderr, " the service at %s dropped the job\n", path);
+        status = 1;
+    }
+
+    free(message.msg_control);
+    free(payload);
+    free(directory);
+    close(client);
+    return status;
+}
+
+// **************************************  //
+// UTILS
+// **************************************  //
+
+/* Sends length bytes through a socket. Returns 0, or -1 if the connection broke first. */
+int
+sendAll(int socket, const void *buffer, size_t length)
+{
+    ssize_t sent;
+
+    for(; length > 0; length -= sent, buffer = (const char *) buffer + sent)
+        if((sent = send(socket, buffer, length, MSG_NOSIGNAL)) <= 0) return -1;
+    return 0;
+}
+
+/* Receives length bytes from a socket. Returns 0, or -1 if the connection broke first. */
+int
+receiveAll(int socket, void *buffer, size_t length)
+{
+    ssize_t received;
+
+    for(; length > 0; length -= received, buffer = (char *) buffer + received)
+        if((received = recv(socket, buffer, length, 0)) <= 0) return -1;
+    return 0;
+}
@@ -0,0 +1,288 @@
+#define _GNU_SOURCE
+
+const int SEEDS_COUNT = 3;
+
+// Replicates each thread may generate ahead of the next one to be written, which bounds the records held in memory
+const int POOL_WINDOW_PER_THREAD = 4;
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ms.h"
+#include "mspar.h"
+
+/*
+ * mspar-threads: mspar for a single computer, without MPI. The replicates are generated by a pool of threads, one
+ * per core unless --threads says otherwise, and written in replicate order by whichever thread completes the next
+ * one. Every replicate is generated from its own RNG stream, so the output is the same as mspar's.
+ */
+
+// **************************************  //
+// SETUP
+// **************************************  //
+
+/*
+ * Generates the whole run with the thread pool. Takes the place of mspar's master/worker setup, so the process is
+ * always the master and there is no worker for ms.c to start.
+ *
+ * @return 0, the rank of the master
+ */
+int
+masterWorkerSetup(int argc, char *argv[], int howmany, struct params parameters, struct msparOptions options)
+{
+    struct threadPool *pool;
+    unsigned short seeds[SEEDS_COUNT];
+    int i, nseeds = SEEDS_COUNT, first = 0, threads = options.threads;
+
+    if(options.output != NULL) openOutput(options);
+    beginHeader(options);
+    for(i=0; i<argc; i++)
+    {
+        fprintf(stdout, "%s ",argv[i]);
+    }
+    doInitializeRng(argc, argv, &nseeds, parameters);
+    endHeader();
+    getStreamsKey(seeds);
+    // The tbs values are read as the threads need them, so they are read ahead no further than the window
+    if(tbsFromInput()) openTbs(stdin);
+
+    if(options.replay >= 0)
+    {
+        size_t length;
+        char *record;
+
+        releaseTbs(options.replay);
+        record = generateSample(options.replay, parameters, &length);
+        renderSample(record);
+        free(record);
+        return 0;
+    }
+    if(options.output != NULL) first = openLedger(options, howmany, seeds);
+    if(options.cache != NULL) first = openCache(options, howmany, first, parameters, seeds);
+    releaseTbs(first);
+
+    if(threads == 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads > howmany - first) threads = howmany - first;
+    if(threads < 1) threads = 1;
+
+    pool = createThreadPool(threads, first, howmany, parameters);
+    poolThread(&pool->queues[0]);
+    destroyThreadPool(pool);
+
+    if(options.output != NULL) writeLedger(howmany);
+    return 0;
+}
+
+void
+masterWorkerTeardown() {
+    closeLedger();
+    closeCache();
+    fflush(stdout);
+}
+
+/* The replicates are generated by the threads of the pool: there are no worker processes. */
+int
+workerProcess(int myRank, int howmany, struct params parameters, struct msparOptions options)
+{
+    (void) myRank;
+    (void) howmany;
+    (void) parameters;
+    (void) options;
+    return 0;
+}
+
+/* Aborts the run, after an error that leaves it without a way to go on. */
+void
+abortRun()
+{
+    exit(1);
+}
+
+// **************************************  //
+// THREAD POOL
+// **************************************  //
+
+/*
+ * Creates the thread pool and starts its threads but the first one, which is the calling thread. Replicates are
+ * dealt to the threads' queues in turns, so the threads move through the run side by side and the next replicate to
+ * be written is never far behind the ones being generated.
+ *
+ * @param size threads of the pool, the calling one included
+ * @param first first replicate to be generated
+ * @param howmany replicates of the run
+ * @param parameters simulation parameters
+ *
+ * @return the pool
+ */
+struct threadPool *
+createThreadPool(int size, int first, int howmany, struct params parameters)
+{
+    int i;
+    struct threadPool *pool = malloc(sizeof(struct threadPool));
+
+    pool->size = size;
+    pool->parameters = parameters;
+    pool->howmany = howmany;
+    pool->next = first;
+    pool->window = POOL_WINDOW_PER_THREAD * size;
+    pool->records = calloc(pool->window, sizeof(char *));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->written, NULL);
+
+    pool->queues = malloc(size * sizeof(struct replicateQueue));
+    for(i=0; i<size; i++)
+    {
+        pool->queues[i].pool = pool;
+        pool->queues[i].next = first + i;
+        pthread_mutex_init(&pool->queues[i].lock, NULL);
+    }
+
+    pool->threads = malloc(size * sizeof(pthread_t));
+    for(i=1; i<size; i++)
+    {
+        if(pthread_create(&pool->threads[i], NULL, poolThread, &pool->queues[i]) != 0)
+        {
+            fprintf(stderr, " could not start the threads of the pool\n");
+            abortRun();
+        }
+    }
+    return pool;
+}
+
+/*
+ * Waits for the threads of the pool, which finish once every replicate is written, and frees the pool.
+ *
+ * @param pool the pool
+ */
+void
+destroyThreadPool(struct threadPool *pool)
+{
+    int i;
+
+    for(i=1; i<pool->size; i++) pthread_join(pool->threads[i], NULL);
+    for(i=0; i<pool->size; i++) pthread_mutex_destroy(&pool->queues[i].lock);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->written);
+    free(pool->threads);
+    free(pool->queues);
+    free(pool->records);
+    free(pool);
+}
+
+/*
+ * Main loop of a thread of the pool: generates replicates until there are none left.
+ *
+ * @param arg the thread's queue
+ *
+ * @return NULL
+ */
+void *
+poolThread(void *arg)
+{
+    struct replicateQueue *queue = arg;
+    struct threadPool *pool = queue->pool;
+    int replicate, self = queue - pool->queues;
+    size_t length;
+
+    while((replicate = takeReplicate(pool, self)) >= 0)
+        writeRecord(pool, replicate, generateSample(replicate, pool->parameters, &length));
+    return NULL;
+}
+
+/*
+ * Takes the next replicate to be generated by a thread: the next one in its own queue or, once that one is beyond the
+ * window or the queue is empty, the oldest one queued at any other thread. Stealing the oldest replicate keeps the
+ * output moving; when all of them are beyond the window, the thread waits for the output to catch up.
+ *
+ * @param pool the pool
+ * @param self the thread's index in the pool
+ *
+ * @return the replicate, or -1 if there are none left
+ */
+int
+takeReplicate(struct threadPool *pool, int self)
+{
+    int i, next, lowest = 0, replicate, victim, limit;
+
+    while(1)
+    {
+        limit = __atomic_load_n(&pool->next, __ATOMIC_ACQUIRE) + pool->window;
+
+        if((replicate = popReplicate(&pool->queues[self], limit)) >= 0) return replicate;
+
+        victim = -1;
+        for(i=0; i<pool->size; i++)
+        {
+            next = __atomic_load_n(&pool->queues[i].next, __ATOMIC_RELAXED);
+            if(next < pool->howmany && (victim < 0 || next < lowest))
+            {
+                victim = i;
+                lowest = next;
+            }
+        }
+        if(victim < 0) return -1;
+        if((replicate = popReplicate(&pool->queues[victim], limit)) >= 0) return replicate;
+        if(lowest < limit) continue; // another thread took it first
+
+        pthread_mutex_lock(&pool->lock);
+        while(pool->next + pool->window <= lowest) pthread_cond_wait(&pool->written, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/*
+ * Takes the next replicate out of a queue, provided it is below the limit.
+ *
+ * @param queue the queue
+ * @param limit first replicate that can not be taken yet
+ *
+ * @return the replicate, or -1 if the queue is empty or its next replicate is not below the limit
+ */
+int
+popReplicate(struct replicateQueue *queue, int limit)
+{
+    int replicate = -1;
+
+    pthread_mutex_lock(&queue->lock);
+    if(queue->next < queue->pool->howmany && queue->next < limit)
+    {
+        replicate = queue->next;
+        __atomic_store_n(&queue->next, queue->next + queue->pool->size, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return replicate;
+}
+
+/*
+ * Hands a generated replicate over to the output. If it is the next one to be written, it is rendered at once along
+ * with the ones after it already waiting for their turn; otherwise it waits in the window.
+ *
+ * @param pool the pool
+ * @param replicate replicate id of the record
+ * @param record the sample record, freed once written
+ */
+void
+writeRecord(struct threadPool *pool, int replicate, char *record)
+{
+    int next;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->records[replicate % pool->window] = record;
+    next = pool->next;
+    while(next < pool->howmany && (record = pool->records[next % pool->window]) != NULL)
+    {
+        renderSample(record);
+        free(record);
+        pool->records[next % pool->window] = NULL;
+        next++;
+    }
+    if(next != pool->next)
+    {
+        __atomic_store_n(&pool->next, next, __ATOMIC_RELEASE);
+        checkpointLedger(next);
+        releaseTbs(next);
+        pthread_cond_broadcast(&pool->written);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,140 @@
+/*  Link in this file for random number generation with a counter-based generator (Philox4x32-10).
+
+    Every replicate draws from its own stream, keyed by the seeds and indexed by the replicate number, so a
+    replicate gets the same numbers whichever process generates it and whatever was generated before.
+    Call replicateStream() before generating each replicate. A replicate's stream is split in substreams, so parts
+    of a replicate can draw their numbers apart from each other (replicateSubstream()); the stream itself is the
+    substream 0. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+
+static unsigned short streamKey[3] = { 3579, 27011, 59243 };
+
+/* counter[0]: block within the substream, counter[1]: substream, counter[2]: replicate, counter[3]: 1 outside every
+   replicate.
+   The position in the streams is thread local, so threads generate replicates at the same time; the key is shared. */
+static __thread uint32_t counter[4] = { 0, 0, 0, 1 };
+static __thread uint32_t block[4];
+static __thread int used = 4;
+
+	static void
+philox( const uint32_t *ctr, const unsigned short *seedv, uint32_t *out )
+{
+	uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3] ;
+	uint32_t k0 = seedv[0] | ((uint32_t) seedv[1] << 16), k1 = seedv[2] ;
+	uint64_t p0, p1 ;
+	int i;
+
+	for( i=0; i<PHILOX_ROUNDS; i++) {
+		p0 = (uint64_t) PHILOX_M0 * c0 ;
+		p1 = (uint64_t) PHILOX_M1 * c2 ;
+		c0 = (uint32_t) (p1 >> 32) ^ c1 ^ k0 ;
+		c2 = (uint32_t) (p0 >> 32) ^ c3 ^ k1 ;
+		c1 = (uint32_t) p1 ;
+		c3 = (uint32_t) p0 ;
+		k0 += PHILOX_W0 ;
+		k1 += PHILOX_W1 ;
+	}
+	out[0] = c0 ; out[1] = c1 ; out[2] = c2 ; out[3] = c3 ;
+}
+
+	double
+ran1()
+{
+	double x;
+
+	if( used >= 4 ) {
+		philox( counter, streamKey, block );
+		counter[0]++ ;	/* 2^32 blocks per substream, far beyond any replicate */
+		used = 0 ;
+	}
+	/* 53 random bits out of two words */
+	x = ( (block[used] >> 5) * 67108864.0 + (block[used+1] >> 6) ) / 9007199254740992.0 ;
+	used += 2 ;
+	return( x );
+}
+
+/* Positions the generator at the start of a substream of the given replicate. */
+	void
+replicateSubstream( int replicate, int substream )
+{
+	counter[0] = 0 ;
+	counter[1] = (uint32_t) substream ;
+	counter[2] = (uint32_t) replicate ;
+	counter[3] = 0 ;
+	used = 4 ;
+}
+
+/* Positions the generator at the start of the stream of the given replicate. */
+	void
+replicateStream( int replicate )
+{
+	replicateSubstream( replicate, 0 );
+}
+
+/* Sets the seeds every stream is keyed by. */
+	void
+setStreamsKey( const unsigned short *seedv )
+{
+	int i;
+
+	for( i=0; i<3; i++) streamKey[i] = seedv[i] ;
+	used = 4 ;
+}
+
+	void
+getStreamsKey( unsigned short *seedv )
+{
+	int i;
+
+	for( i=0; i<3; i++) seedv[i] = streamKey[i] ;
+}
+
+
+	void seedit( const char *flag )
+{
+	FILE *fopen(), *pfseed;
+	unsigned short seedv[3] ;
+	int i;
+
+	if( flag[0] == 's' ) {
+	   pfseed = fopen("seedms","r");
+	   if( pfseed != NULL ) {
+           for(i=0;i<3;i++){
+		       if(  fscanf(pfseed," %hd",seedv+i) < 1 )
+		            seedv[i] = streamKey[i] ;
+		   }
+	       fclose( pfseed);
+	       setStreamsKey( seedv );
+	   }
+       printf("\n%d %d %d\n", streamKey[0], streamKey[1], streamKey[2] );
+	}
+	else {
+	     /* next run starts from new seeds */
+	     pfseed = fopen("seedms","w");
+         fprintf(pfseed,"%d %d %d\n", (int) (ran1()*65536), (int) (ran1()*65536), (int) (ran1()*65536) );
+		fclose( pfseed) ;
+	}
+}
+
+	int
+commandlineseed( char **seeds)
+{
+	unsigned short seedv[3];
+
+	seedv[0] = atoi( seeds[0] );
+	seedv[1] = atoi( seeds[1] );
+	seedv[2] = atoi( seeds[2] );
+	printf("\n%d %d %d\n", seedv[0], seedv[1], seedv[2] );
+
+	setStreamsKey( seedv );
+	return(3);
+}
@@ -42,13 +42,14 @@
 
 extern int flag;
 
-int nchrom, begs, nsegs;
-long nlinks ;
-static int *nnodes = NULL ;  
-double t, cleft , pc, lnpc ;
+/* The simulation state is thread local, so every simulation thread of mspar (--threads) has its own. */
+__thread int nchrom, begs, nsegs;
+__thread long nlinks ;
+static __thread int *nnodes = NULL ;  
+__thread double t, cleft , pc, lnpc ;
 
-static unsigned seglimit = SEGINC ;
-static unsigned maxchr ;
+static __thread unsigned seglimit = SEGINC ;
+static __thread unsigned maxchr ;
 
 struct seg{
 	int beg;
@@ -62,16 +63,16 @@ struct chromo{
 	struct seg  *pseg;
 	} ;
 
-static struct chromo *chrom = NULL ;
+static __thread struct chromo *chrom = NULL ;
 
-struct node *ptree1, *ptree2;
+__thread struct node *ptree1, *ptree2;
 
 struct segl {
 	int beg;
 	struct node *ptree;
 	int next;
 	}  ;
-static struct segl *seglst = NULL ;
+static __thread struct segl *seglst = NULL ;
 
 	struct segl *
 segtre_mig(struct c_params *cp, int *pnsegs ) 
@@ -0,0 +1,147 @@
+/*
+ * Microbenchmark of bufferFixed (msparformat.c) against the printf formatting it replaces, for the two kinds of
+ * numbers mspar prints: positions in [0,1) ("%6.*lf", -p precision) and branch lengths ("%5.3lf").
+ *
+ * Before timing anything it checks that both produce the same text for every value, which includes exact ties, values
+ * right next to them and precisions too long for the fast path of formatFixed. Build it with 'make bench' and run it
+ * from the top folder:
+ *
+ *    bin/formatbench [values]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "ms.h"
+#include "mspar.h"
+
+const int DEFAULT_VALUES = 1000000;
+
+// Room for the text of a number at the highest precision checked
+#define CHECK_LENGTH 256
+
+/* Seconds elapsed since some fixed point in time. */
+double
+now()
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+/*
+ * Checks bufferFixed against snprintf for some values.
+ *
+ * @return number of values formatted differently
+ */
+int
+check(const double *values, int count, int width, int precision)
+{
+    struct outputBuffer text = { NULL, 0, 0 };
+    char expected[CHECK_LENGTH];
+    int i, mismatches = 0;
+
+    for(i=0; i<count; i++)
+    {
+        snprintf(expected, sizeof(expected), "%*.*lf", width, precision, values[i]);
+        text.length = 0;
+        bufferFixed(&text, values[i], width, precision);
+        if((strlen(expected) != text.length || strcmp(expected, text.text) != 0) && mismatches++ < 10)
+            fprintf(stderr, " %.17g (%%%d.%dlf): printf \"%s\", bufferFixed \"%s\"\n", values[i], width, precision,
+                    expected, text.text);
+    }
+    free(text.text);
+    return mismatches;
+}
+
+/* Times formatting some values both ways, and prints the nanoseconds per value of each. */
+void
+bench(const char *name, const double *values, int count, int width, int precision)
+{
+    struct outputBuffer buffer = { NULL, 0, 0 };
+    char text[FIXED_LENGTH];
+    double start, printfTime, fixedTime;
+    size_t total = 0;
+    int i;
+
+    start = now();
+    for(i=0; i<count; i++) total += sprintf(text, "%*.*lf", width, precision, values[i]);
+    printfTime = now() - start;
+
+    start = now();
+    for(i=0; i<count; i++)
+    {
+        buffer.length = 0;
+        bufferFixed(&buffer, values[i], width, precision);
+        total -= buffer.length;
+    }
+    fixedTime = now() - start;
+    free(buffer.text);
+
+    printf("%-28s printf %7.1f ns   bufferFixed %7.1f ns   speedup %5.2fx%s\n", name, 1e9 * printfTime / count,
+           1e9 * fixedTime / count, printfTime / fixedTime, total == 0 ? "" : "   (lengths differ!)");
+}
+
+int
+main(int argc, char *argv[])
+{
+    int i, precision, count = argc > 1 ? atoi(argv[1]) : DEFAULT_VALUES, mismatches = 0;
+    double *positions, *lengths, *ties;
+    char name[64];
+
+    if(count < 1)
+    {
+        fprintf(stderr, "usage: %s [values]\n", argv[0]);
+        return 1;
+    }
+    positions = (double *) malloc(count * sizeof(double));
+    lengths = (double *) malloc(count * sizeof(double));
+    ties = (double *) malloc(count * sizeof(double));
+
+    srand48(2015);
+    for(i=0; i<count; i++)
+    {
+        positions[i] = drand48();
+        lengths[i] = -log(1.0 - drand48()) * (i % 2 ? 0.1 : 10.0);
+        // multiples of 2^-12 (exact ties at low precisions) and their neighbours
+        ties[i] = floor(drand48() * 4096) / 4096;
+        if(i % 3 > 0) ties[i] = nextafter(ties[i], i % 3 == 1 ? 0.0 : 1.0);
+    }
+
+    for(precision = 0; precision <= 20; precision++)
+    {
+        mismatches += check(positions, count, 6, precision);
+        mismatches += check(ties, count, 6, precision);
+    }
+    // Too long for the fast path, and for its room of FIXED_LENGTH bytes
+    for(precision = 30; precision <= 100; precision += 35)
+    {
+        mismatches += check(positions, count / 100 + 1, 6, precision);
+        mismatches += check(lengths, count / 100 + 1, 5, precision);
+    }
+    mismatches += check(lengths, count, 5, 3);
+    mismatches += check(lengths, count, 0, 0);
+    if(mismatches > 0)
+    {
+        fprintf(stderr, " %d values formatted differently from printf\n", mismatches);
+        return 1;
+    }
+    printf("%d values per case, all formatted as printf does\n", count);
+
+    for(precision = 2; precision <= 10; precision += 2)
+    {
+        sprintf(name, "positions (%%6.%dlf)", precision);
+        bench(name, positions, count, 6, precision);
+    }
+    bench("branch lengths (%5.3lf)", lengths, count, 5, 3);
+
+    free(positions);
+    free(lengths);
+    free(ties);
+    return 0;
+}
@@ -0,0 +1,386 @@
+#!/bin/bash
+#
+# Regression tests of mspar's modes. Every replicate is generated from its own RNG stream, so whatever the processes,
+# threads or scheduling generating a run, it must write the same samples as a plain run of mspar-threads on a single
+# thread with the same seeds.
+#
+# Run them from the top folder with 'make check'. MPIRUN says how mspar is started (default: mpirun --oversubscribe);
+# without mpirun the MPI tests are skipped.
+
+cd "$(dirname "$0")/.."
+BIN=./bin
+MPIRUN=${MPIRUN:-mpirun --oversubscribe}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+passed=0
+failed=0
+
+# Parameters the modes are tested with: recombination, trees, migration and events, fixed segsites
+CASES=(
+    "4 50 -seeds 1 2 3 -t 10 -T"
+    "20 10 -seeds 1 2 3 -t 100 -r 200 10000"
+    "15 30 -seeds 40328 19150 54118 -t 10 -r 10 100000 -I 3 10 4 1 -ma x 5 5 5 x 5 5 5 x -eN 0.8 15 -ej .7 2 1 -ej 1 3 1"
+    "10 7 -seeds 5 6 7 -s 20 -r 3 1000 -p 7"
+)
+
+# Samples of an output: all of it but the first line, the command line that wrote it
+samples() {
+    tail -n +2
+}
+
+# Plain run, the reference: mspar-threads on a single thread
+plain() {
+    $BIN/mspar-threads "$@" --threads 1 </dev/null | samples
+}
+
+# mspar-threads, on as many threads as cores unless told otherwise
+threads() {
+    $BIN/mspar-threads "$@" </dev/null | samples
+}
+
+# mspar on n processes: mpi n arguments
+mpi() {
+    local n=$1
+    shift
+    $MPIRUN -n $n $BIN/mspar "$@" </dev/null 2>/dev/null | samples
+}
+
+# Passes if the output of the test (actual) is the expected one: check name. The output is removed afterwards, so a
+# test that fails to write one can not pass with the previous test's.
+check() {
+    if [ -s "$WORK/expected" ] && cmp -s "$WORK/expected" "$WORK/actual"; then
+        passed=$((passed + 1))
+    else
+        failed=$((failed + 1))
+        echo "FAIL: $1"
+    fi
+    rm -f "$WORK/actual"
+}
+
+# Runs a command writing to $WORK/out in the background, and kills every process of it (SIGKILL) as soon as its ledger
+# records a checkpoint: interrupt command...
+interrupt() {
+    local pid replicates
+    "$@" </dev/null >/dev/null 2>&1 &
+    pid=$!
+    while kill -0 $pid 2>/dev/null; do
+        replicates=$(sed -n 's/^replicates //p' "$WORK/out.ledger" 2>/dev/null)
+        if [ -n "$replicates" ] && [ "$replicates" -gt 0 ]; then
+            # mpirun's ranks outlive it: they are found by their output
+            pkill -9 -f -- "--output $WORK/out"
+            break
+        fi
+        sleep 0.05
+    done
+    wait $pid 2>/dev/null
+    while pgrep -f -- "--output $WORK/out" >/dev/null; do sleep 0.1; done
+}
+
+# Replicates the ledger of $WORK/out records, 0 without a ledger
+recorded() {
+    sed -n 's/^replicates //p' "$WORK/out.ledger" 2>/dev/null || echo 0
+}
+
+# Runs mspar-threads or mspar (on 3 processes) with the cache in $WORK/cache, writing the samples to $WORK/actual, and
+# prints the blocks it served: cached program arguments...
+cached() {
+    local program=$1
+    shift
+    if [ $program = mspar ]; then
+        $MPIRUN -n 3 $BIN/mspar "$@" --cache "$WORK/cache" </dev/null 2>"$WORK/stderr"
+    else
+        $BIN/mspar-threads "$@" --cache "$WORK/cache" </dev/null 2>"$WORK/stderr"
+    fi | samples > "$WORK/actual"
+    grep -o '[0-9]* blocks hit' "$WORK/stderr"
+}
+
+has_mpi() {
+    command -v ${MPIRUN%% *} >/dev/null && [ -x $BIN/mspar ]
+}
+
+# **************************************  #
+# TESTS
+# **************************************  #
+
+# Any number of threads, more than replicates included, and of threads mutating the segments of every replicate
+test_threads() {
+    local case n
+    for case in "${CASES[@]}"; do
+        plain $case > "$WORK/expected"
+        for n in 2 3 16; do
+            threads $case --threads $n > "$WORK/actual"
+            check "$n threads: $case"
+        done
+        for n in 2 5; do
+            threads $case --threads 3 --segment-threads $n > "$WORK/actual"
+            check "3 threads, $n segment threads: $case"
+        done
+        has_mpi || continue
+        mpi 3 $case --threads 2 --segment-threads 3 > "$WORK/actual"
+        check "3 processes, 2 threads, 3 segment threads: $case"
+    done
+}
+
+# Any number of processes and any scheduling policy
+test_scheduling() {
+    local case n policy
+    for case in "${CASES[@]}"; do
+        plain $case > "$WORK/expected"
+        for n in 2 3 5; do
+            for policy in dynamic rma static auto; do
+                mpi $n $case --scheduling $policy > "$WORK/actual"
+                check "$n processes, $policy scheduling: $case"
+            done
+        done
+    done
+}
+
+# Idle workers re-running the work units still running at the tail of the run: the copy delivering first wins
+test_speculate() {
+    local case n
+    for case in "${CASES[@]}"; do
+        plain $case > "$WORK/expected"
+        for n in 3 5; do
+            mpi $n $case --speculate > "$WORK/actual"
+            check "$n processes, --speculate: $case"
+        done
+    done
+    # few long replicates, so most of the run is a tail with copies racing
+    plain 40 12 -t 200 -r 400 10000 -seeds 4 5 6 > "$WORK/expected"
+    mpi 4 40 12 -t 200 -r 400 10000 -seeds 4 5 6 --speculate > "$WORK/actual"
+    check "4 processes, --speculate with few long replicates"
+}
+
+# Samples larger than a fragment (FRAGMENT_SIZE, 4 MB), so every work unit is sent in several of them
+test_fragments() {
+    local run="500 6 -t 1000 -seeds 7 8 9" mode
+    plain $run > "$WORK/expected"
+    for mode in "" "--no-shared-memory" "--hierarchy 2" "--speculate"; do
+        mpi 4 $run $mode > "$WORK/actual"
+        check "4 processes, fragmented results $mode"
+    done
+}
+
+# Every set of a sweep writes the output of a run of the set alone, header included, and the run itself writes nothing
+# to the standard output
+test_sweep() {
+    local i program set args
+    for i in 0 1 2 3; do
+        echo "$WORK/set$i ${CASES[$i]% -seeds*} ${CASES[$i]#*-seeds * * * }"
+    done > "$WORK/manifest"
+
+    for program in mspar-threads mspar; do
+        rm -f "$WORK"/set*
+        if [ $program = mspar ]; then
+            has_mpi || return
+            $MPIRUN -n 3 $BIN/mspar --sweep "$WORK/manifest" -seeds 1 2 3 </dev/null 2>/dev/null > "$WORK/stdout"
+        else
+            $BIN/mspar-threads --sweep "$WORK/manifest" -seeds 1 2 3 </dev/null > "$WORK/stdout"
+        fi
+        if [ -s "$WORK/stdout" ]; then
+            failed=$((failed + 1))
+            echo "FAIL: $program, sweep: output on stdout"
+        fi
+
+        while read set args; do
+            { echo "$BIN/$program $args -seeds 1 2 3 "; plain $args -seeds 1 2 3; } > "$WORK/expected"
+            cp "$set" "$WORK/actual"
+            check "$program, sweep set: $args"
+        done < "$WORK/manifest"
+    done
+}
+
+# A run killed after a checkpoint and resumed writes the same output as if it had never been interrupted
+test_resume() {
+    local run="30 3000 -t 30 -r 30 1000 -seeds 1 2 3" output="--output $WORK/out --checkpoint 10" partial
+    plain $run > "$WORK/expected"
+
+    rm -f "$WORK"/out*
+    interrupt $BIN/mspar-threads $run --threads 2 $output
+    partial=$(recorded)
+    $BIN/mspar-threads $run --threads 2 $output --resume </dev/null
+    samples < "$WORK/out" > "$WORK/actual"
+    [ "$partial" -lt 3000 ] || : > "$WORK/actual"
+    check "mspar-threads, resumed after a kill at replicate $partial"
+
+    has_mpi || return
+    rm -f "$WORK"/out*
+    interrupt $MPIRUN -n 3 $BIN/mspar $run $output
+    partial=$(recorded)
+    $MPIRUN -n 3 $BIN/mspar $run $output --resume </dev/null 2>/dev/null
+    samples < "$WORK/out" > "$WORK/actual"
+    [ "$partial" -lt 3000 ] || : > "$WORK/actual"
+    check "3 processes, resumed after a kill at replicate $partial"
+}
+
+# Values of tbs arguments read from stdin: they are printed on the // line of every sample as they were given, and
+# any number of threads or processes writes the samples of a plain run
+test_tbs() {
+    local run="12 200 -t tbs -r tbs 1000 -seeds 1 2 3" n mode
+    awk 'BEGIN { for(i = 0; i < 200; i++) printf "%.1f %d\n", 1 + i % 20, i % 7 * 5 }' > "$WORK/tbs"
+
+    printf '//\t1.0\t0\n//\t2.0\t5\n' > "$WORK/expected"
+    $BIN/mspar-threads $run < "$WORK/tbs" | grep -m 2 '^//' > "$WORK/actual"
+    check "tbs values on the // line"
+
+    $BIN/mspar-threads $run --threads 1 < "$WORK/tbs" | samples > "$WORK/expected"
+    for n in 2 3 16; do
+        $BIN/mspar-threads $run --threads $n < "$WORK/tbs" | samples > "$WORK/actual"
+        check "$n threads, tbs values"
+    done
+
+    has_mpi || return
+    for n in 2 3 5; do
+        for mode in "" "--scheduling auto" "--master-works" "--speculate"; do
+            $MPIRUN -n $n $BIN/mspar $run $mode < "$WORK/tbs" 2>/dev/null | samples > "$WORK/actual"
+            check "$n processes, tbs values $mode"
+        done
+    done
+    $MPIRUN -n 5 $BIN/mspar $run --hierarchy 2 < "$WORK/tbs" 2>/dev/null | samples > "$WORK/actual"
+    check "5 processes, tbs values --hierarchy 2"
+}
+
+# ABC rejection (--abc): the statistics of every sample are the ones sample_stats works out from its ms output, and
+# the rows accepted are the same whatever the threads, processes or scheduling
+test_abc() {
+    local run="20 300 -t tbs -r tbs 100 -seeds 4 5 6" abc="--abc pi,ss,D,thetaH,H" n policy
+    local priors="--prior 1:20 --prior 0:10 --observed 5,20,-0.5,5,0 --tolerance 2"
+    awk 'BEGIN { for(i = 0; i < 300; i++) printf "%.1f %d\n", 1 + i % 20, i % 7 * 5 }' > "$WORK/tbs"
+
+    # Every sample accepted: a row of its tbs values and statistics each
+    $BIN/mspar-threads $run --threads 1 < "$WORK/tbs" | $BIN/sample_stats \
+        | awk -F'\t' '{ printf "%f\t%f\t%s\t%f\t%s\t%s\t%s\n", $11, $12, $2, $4, $6, $8, $10 }' > "$WORK/expected"
+    $BIN/mspar-threads $run $abc --observed 1,1,1,1,1 --tolerance 1e9 < "$WORK/tbs" | tail -n +3 > "$WORK/actual"
+    check "ABC statistics against sample_stats"
+
+    plain $run $abc $priors > "$WORK/expected"
+    for n in 2 3 16; do
+        threads $run $abc $priors --threads $n > "$WORK/actual"
+        check "$n threads, ABC rejection"
+    done
+
+    has_mpi || return
+    for n in 2 3 5; do
+        for policy in dynamic rma static auto; do
+            mpi $n $run $abc $priors --scheduling $policy > "$WORK/actual"
+            check "$n processes, $policy scheduling, ABC rejection"
+        done
+    done
+}
+
+# mspar-threads as a service (--serve): the jobs handed over to it write the samples of a plain run, reading their tbs
+# values from the client's stdin, and its socket is open to its user alone
+test_service() {
+    local case service
+    $BIN/mspar-threads --serve "$WORK/socket" &
+    service=$!
+    while [ ! -S "$WORK/socket" ] && kill -0 $service 2>/dev/null; do sleep 0.05; done
+
+    echo 600 > "$WORK/expected"
+    stat -c %a "$WORK/socket" > "$WORK/actual"
+    check "service socket permissions"
+
+    for case in "${CASES[@]}"; do
+        plain $case > "$WORK/expected"
+        $BIN/mspar-threads --connect "$WORK/socket" $case </dev/null | samples > "$WORK/actual"
+        check "service job: $case"
+    done
+
+    awk 'BEGIN { for(i = 0; i < 50; i++) printf "%.1f\n", 1 + i % 20 }' > "$WORK/tbs"
+    $BIN/mspar-threads 10 50 -t tbs -seeds 1 2 3 --threads 1 < "$WORK/tbs" | samples > "$WORK/expected"
+    $BIN/mspar-threads --connect "$WORK/socket" 10 50 -t tbs -seeds 1 2 3 < "$WORK/tbs" | samples > "$WORK/actual"
+    check "service job with tbs values"
+
+    kill $service
+    wait $service 2>/dev/null
+}
+
+# Result cache (--cache): a run served from the cache, wholly or in part, writes the samples of a plain run, and a
+# cache too small for a run keeps its first blocks, the ones a later run is served from
+test_cache() {
+    local run="20 2500 -t 10 -seeds 1 2 3" program hits
+    for program in mspar-threads mspar; do
+        [ $program = mspar ] && ! has_mpi && return
+        rm -rf "$WORK/cache"
+        plain $run > "$WORK/expected"
+        cached $program $run >/dev/null
+        check "$program, cold cache"
+        hits=$(cached $program $run)
+        [ "$hits" = "3 blocks hit" ] || : > "$WORK/actual"
+        check "$program, warm cache ($hits)"
+
+        # the last block of the run above holds 500 replicates, so the first two blocks alone are served
+        plain 20 4000 -t 10 -seeds 1 2 3 > "$WORK/expected"
+        hits=$(cached $program 20 4000 -t 10 -seeds 1 2 3)
+        [ "$hits" = "2 blocks hit" ] || : > "$WORK/actual"
+        check "$program, partly cached run ($hits)"
+
+        # blocks of about 430 kB, so a cache of 1 MB keeps two of them
+        rm -rf "$WORK/cache"
+        plain 20 6000 -t 10 -seeds 1 2 3 > "$WORK/expected"
+        cached $program 20 6000 -t 10 -seeds 1 2 3 --cache-size 1 >/dev/null
+        hits=$(cached $program 20 6000 -t 10 -seeds 1 2 3 --cache-size 1)
+        [ "$hits" = "2 blocks hit" ] || : > "$WORK/actual"
+        check "$program, run served from a full cache ($hits)"
+    done
+}
+
+# Binary output (--binary): written in little-endian byte order whatever the machine, and printed by mspar-convert as
+# the ms output of a plain run, which sample_stats reads just the same
+test_binary() {
+    local case run="20 300 -t 10 -r 10 1000 -seeds 4 5 6"
+    for case in "${CASES[@]}"; do
+        plain $case > "$WORK/expected"
+        $BIN/mspar-threads $case --binary </dev/null > "$WORK/binary"
+        $BIN/mspar-convert "$WORK/binary" | samples > "$WORK/actual"
+        check "mspar-threads --binary: $case"
+        has_mpi || continue
+        $MPIRUN -n 3 $BIN/mspar $case --binary </dev/null 2>/dev/null | $BIN/mspar-convert | samples > "$WORK/actual"
+        check "3 processes, --binary: $case"
+    done
+
+    printf 'mspar binary 2\n\004\003\002\001' > "$WORK/expected"
+    head -c 19 "$WORK/binary" > "$WORK/actual"
+    check "binary output byte order mark"
+
+    $BIN/mspar-threads $run --threads 1 </dev/null | $BIN/sample_stats > "$WORK/expected"
+    $BIN/mspar-threads $run --binary </dev/null | $BIN/mspar-convert | $BIN/sample_stats > "$WORK/actual"
+    check "sample_stats of converted binary output"
+}
+
+# Positions at a precision too long for the fast formatting path: printed in full, as printf prints them, by a run
+# and by mspar-convert
+test_precision() {
+    local run="4 20 -t 2 -seeds 1 2 3 -p 70"
+    plain $run | awk '/^positions:/ { printf "positions: "; for(i = 2; i <= NF; i++) printf "%6.70f ", $i; print ""; next }
+                      { print }' > "$WORK/expected"
+    plain $run > "$WORK/actual"
+    check "positions at -p 70"
+    $BIN/mspar-threads $run --binary </dev/null | $BIN/mspar-convert | samples > "$WORK/actual"
+    check "positions at -p 70, --binary"
+}
+
+# **************************************  #
+# MAIN
+# **************************************  #
+
+test_threads
+test_resume
+test_sweep
+test_tbs
+test_abc
+test_service
+test_cache
+test_binary
+test_precision
+if has_mpi; then
+    test_scheduling
+    test_speculate
+    test_fragments
+else
+    echo "mpirun or bin/mspar missing: MPI tests skipped"
+fi
+
+echo "$passed passed, $failed failed"
+[ $failed -eq 0 ]